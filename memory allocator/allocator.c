@@ -1,29 +1,139 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "arena.h"
+
+//The per-CPU caches need rseq and the restartable sequences below, which are written for x86-64.
+//Elsewhere every thread uses its own cache.
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#define CPU_CACHES_SUPPORTED
+//Weak, so the library still loads with a C library that registers no rseq area of its own
+#pragma weak __rseq_offset
+#pragma weak __rseq_size
+#define STRINGIFY(x) #x
+#define EXPAND_TO_STRING(x) STRINGIFY(x)
+#endif
+
 // The minimum size returned by malloc
 #define MIN_MALLOC_SIZE 16
-//The verfication of a page came from the allocator
-#define MAGIC_NUMBER 1571605839
 //The maximum size
 #define MAX_SMALL_SIZE 2048
 // The size of a single page of memory, in bytes
 #define PAGE_SIZE 0x1000
+// The size of each chunk of the heap that is mapped at once and carved into pages and spans
+#define SUPERBLOCK_SIZE (4 * 1024 * 1024)
+// The number of pages in a superblock
+#define SUPERBLOCK_PAGES (SUPERBLOCK_SIZE / PAGE_SIZE)
+// The longest medium span, in pages, and the largest medium object it holds
+#define MAX_MEDIUM_PAGES 64
+#define MAX_MEDIUM_SIZE (MAX_MEDIUM_PAGES * PAGE_SIZE)
+// The address space reserved for small and medium objects, and the number of pages in it
+#define HEAP_RESERVE_SIZE (64UL * 1024 * 1024 * 1024)
+#define HEAP_PAGES (HEAP_RESERVE_SIZE / PAGE_SIZE)
+// The size of a transparent huge page, the number of pages in one, and the number in the heap
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_PAGE_PAGES (HUGE_PAGE_SIZE / PAGE_SIZE)
+#define HEAP_HUGE_PAGES (HEAP_RESERVE_SIZE / HUGE_PAGE_SIZE)
+// The page_classes entry of the first page of a medium object and of every page of an arena's
+// span. Small pages store their size class plus one, and every other page stores 0.
+#define PAGE_CLASS_MEDIUM 0xFF
+#define PAGE_CLASS_ARENA 0xFE
+// The number of medium object size classes
+#define NUM_MEDIUM_CLASSES 20
 // Round a value x up to the next multiple of y
 #define ROUND_UP(x, y) ((x) % (y) == 0 ? (x) : (x) + ((y) - (x) % (y)))
+// The number of small object size classes
+#define NUM_SIZE_CLASSES 24
+// The largest number of objects moved between a thread cache and the central pool at once
+#define MAX_BATCH_SIZE 32
+// The number of slots the large object table starts with (a power of two)
+#define LARGE_TABLE_MIN_CAPACITY 512
+// The most freed large mappings kept for reuse, and the most bytes they may hold in total
+#define LARGE_CACHE_ENTRIES 32
+#define LARGE_CACHE_MAX_BYTES (64 * 1024 * 1024)
+// The length of an arena's first span, in pages. Each later span is twice as long as the one
+// before, up to MAX_MEDIUM_PAGES.
+#define ARENA_FIRST_SPAN_PAGES 4
+// The number of completely free pages each size class always keeps before giving pages back to
+// the OS
+#define EMPTY_PAGES_KEPT 2
+// Beyond that, a size class keeps empty pages up to this fraction of the most pages it has held
+// at once, but never more than EMPTY_BYTES_KEPT of them. Empty pages pile up to twice that
+// reserve before any are released, and then they go down to the reserve together.
+#define EMPTY_PAGES_PEAK_FRACTION 2
+#define EMPTY_BYTES_KEPT (512 * 1024)
+// The most empty pages sorted at once to find neighbours that can be released together
+#define EMPTY_PAGES_RELEASE_BATCH 64
+// The most threads that can own pages at once; threads beyond this keep every object they free
+#define MAX_PAGE_OWNERS 1024
+// The number of rows in the statistics report: every small class, every medium class, and large
+#define NUM_STATS_CLASSES (NUM_SIZE_CLASSES + NUM_MEDIUM_CLASSES + 1)
+// The environment variable that turns on the statistics dump. Its value names when to dump:
+// "exit", "signal" (on SIGUSR2), or both.
+#define STATS_ENV_VAR "XXMALLOC_STATS"
+// The environment variable that turns on huge page mode when set to 1
+#define HUGE_PAGES_ENV_VAR "XXMALLOC_HUGE_PAGES"
+// The environment variable that puts threads on per-CPU caches instead of their own when set to 1
+#define PER_CPU_ENV_VAR "XXMALLOC_PER_CPU"
+// The most CPUs that get caches; threads on CPUs numbered higher go to the central pools directly
+#define MAX_CPUS 1024
+// The number of lists a size class sorts its partly used pages into by how full they are
+#define FULLNESS_BUCKETS 8
+// The most objects a per-CPU cache list can hold. A class's list holds at most two batches.
+#define CPU_CACHE_SLOTS (2 * MAX_BATCH_SIZE)
+// The environment variable that starts the background scavenger when set to 1
+#define SCAVENGE_ENV_VAR "XXMALLOC_SCAVENGE"
+// The fewest completely free pages each size class keeps while the scavenger runs, in place of
+// EMPTY_PAGES_KEPT. The scavenger releases the extra pages once they have sat unused.
+#define SCAVENGER_EMPTY_PAGES_KEPT 64
+// The bounds of the scavenger's sleep between passes, and where it starts
+#define SCAVENGER_MIN_INTERVAL_MS 10
+#define SCAVENGER_MAX_INTERVAL_MS 1000
+#define SCAVENGER_START_INTERVAL_MS 100
+// Above this many pages, spans and mappings handed out per second the heap counts as busy, and
+// the scavenger backs off so memory that is about to be reused is not released
+#define SCAVENGER_BUSY_RATE 2000
 
-//contructing a page header used for size checking and boundary checking
+// Statistics counters are read by other threads while they change, so every access is atomic.
+// Relaxed ordering is enough for counters, and a counter only its owning thread writes is bumped
+// with a plain load and store rather than a locked add.
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(counter, n) __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_BUMP(counter) __atomic_store_n(&(counter), (counter) + 1, __ATOMIC_RELAXED)
+#define STAT_BUMP_BY(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+//The header of one heap page, used for size checking. Headers live in a side table indexed by
+//page number rather than in the pages, so every byte of a page holds objects. Small pages also
+//keep their own free list and live-object count, so a page whose objects are all free can be
+//found and given back to the kernel. Slots that have never been used are not on the free list;
+//they are handed out in order from the bump offset, so a new page is only touched as it fills up.
+//A small page is owned by the thread that took objects from it while no running thread owned
+//it; other threads send the page's objects back to that thread when they free them.
 typedef struct page_header_t {
-    long magic;
-    size_t object_size;
+  uint32_t object_size;           // the class size of a small page, or a medium object's size
+  struct free_object_t* freelist; // free objects in this page, not counting thread caches
+  struct page_header_t* next;     // neighbours in the size class's list of pages this full
+  struct page_header_t* prev;
+  uint16_t live;                  // objects taken from this page and not yet returned to it
+  uint16_t bump;                  // offset of the first slot never handed out
+  uint16_t end;                   // offset just past the last slot in the page
+  uint16_t owner;                 // the owning thread's remote_lists index, 0 if none
 } page_header_t;
 
 //checking which size block that the ptr is in
@@ -39,9 +149,290 @@ typedef struct free_object_t {
     struct free_object_t* next;
 } free_object_t;
 
-//The freelist of difference sizes
-free_object_t* freelists[8]; // 16, 32, 64, 128, 256, 512, 1024, 2048
+//Each thread keeps its own free lists, so the common malloc/free path touches no shared data
+//Each thread also counts its own small allocations and frees, which are summed when read.
+typedef struct thread_cache_t {
+  free_object_t* freelists[NUM_SIZE_CLASSES]; // one list per size class, see SIZE_CLASS_LIST
+  size_t counts[NUM_SIZE_CLASSES];            // number of objects on each free list
+  bool registered;                            // true once the exit destructor is installed
+  bool torn_down;                             // true once the exit destructor has run
+  uint16_t owner;                             // this thread's remote_lists index, 0 if none
+  struct rseq* rseq;                          // the thread's rseq area if it uses per-CPU caches
+  size_t scavenger_pass;                      // the scavenger pass the cache last shrank for
+  size_t allocations[NUM_SIZE_CLASSES];       // objects of each class this thread allocated
+  size_t frees[NUM_SIZE_CLASSES];             // objects of each class this thread freed
+  struct thread_cache_t* next;                // neighbours among the registered thread caches
+  struct thread_cache_t* prev;
+} thread_cache_t;
+
+//The shared pool of free objects for one size class: the pages of that class with at least one
+//free object. Partly used pages are sorted into FULLNESS_BUCKETS lists by the share of their
+//slots in use, and batches are taken from the fullest page first. The pages that are nearly
+//full fill up, while the nearly empty ones are left alone until their last objects are freed
+//and they can be given back; live objects end up packed onto fewer pages. Empty pages wait on a
+//list of their own to be reused or given back.
+//Locking: each central list has its own lock, and only the slow paths (refilling or trimming a
+//thread cache) take it, so malloc and free never lock when the thread cache can serve them.
+//Locks are always taken in increasing size-class order and a thread never holds two of them
+//except inside xxmalloc_lock, which takes all of them around fork(). superblock_lock (the span
+//heap) is taken while a central lock is held, so it follows them; large_lock comes next, and
+//stats_lock, which is never held while taking another lock, comes last.
+typedef struct central_list_t {
+  pthread_mutex_t lock;
+  page_header_t* partial[FULLNESS_BUCKETS]; // partly used pages, from least to most full
+  page_header_t* empty;  // pages with no live objects, most recently emptied first
+  size_t empty_pages;    // pages on the empty list
+  size_t pages_mapped;   // pages ever allocated to the class
+  size_t pages_released; // pages the class gave back to the span heap
+  size_t peak_pages;     // the most pages the class has held at once
+} central_list_t;
+
+//Objects freed by one thread into pages owned by another. Any thread pushes onto the owner's
+//list with a compare-and-swap, and only the owner pops, taking the whole list at once, so the
+//list needs no lock and has no ABA problem. Lists outlive their threads: a list whose thread has
+//exited is inactive until a new thread adopts it, along with anything still on it.
+typedef struct remote_list_t {
+  free_object_t* head; // objects waiting for the owner, of any size class
+  bool active;         // whether a running thread owns this list
+} __attribute__((aligned(64))) remote_list_t;
+
+//Every page owner's remote free list. Index 0 stands for no owner and is never used.
+static remote_list_t remote_lists[MAX_PAGE_OWNERS];
+
+//The calling thread's cache. initial-exec keeps the access a single TLS-relative load.
+static __thread thread_cache_t thread_cache __attribute__((tls_model("initial-exec")));
+
+//One size class's objects cached for one CPU: a stack of count objects. Only threads running on
+//that CPU change it, and only inside restartable sequences, which the kernel restarts if the
+//thread is preempted, signalled or migrated before the sequence stores the new count.
+typedef struct cpu_list_t {
+  size_t count;
+  free_object_t* slots[CPU_CACHE_SLOTS];
+} cpu_list_t;
+
+//The cache of one CPU, shared by every thread that runs there. With many more threads than CPUs
+//this holds far fewer idle objects than a cache per thread.
+typedef struct cpu_cache_t {
+  cpu_list_t lists[NUM_SIZE_CLASSES];
+} __attribute__((aligned(64))) cpu_cache_t;
+
+//MAX_CPUS caches, only backed where used, or NULL unless PER_CPU_ENV_VAR turned them on
+static cpu_cache_t* cpu_caches = NULL;
+static pthread_once_t cpu_caches_once = PTHREAD_ONCE_INIT;
+
+#ifdef CPU_CACHES_SUPPORTED
+//The rseq area registered for a thread when the C library has not registered one
+static __thread struct rseq own_rseq __attribute__((tls_model("initial-exec"))) = {
+    .cpu_id = RSEQ_CPU_ID_UNINITIALIZED};
+#endif
+
+//The central pools of difference sizes
+static central_list_t central_lists[NUM_SIZE_CLASSES] = {
+    [0 ... NUM_SIZE_CLASSES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+//A run of pages inside a superblock. Every span has a descriptor for its first and its last
+//page, so a span being freed can find and merge with free neighbours on both sides.
+typedef struct span_t {
+  struct span_t* next; // neighbours in a free-span bin, only used while the span is free
+  struct span_t* prev;
+  uint32_t pages;      // the length of the span in pages
+  uint8_t free;        // whether the span is free
+  uint8_t released;    // whether all of a free span's pages were given back; first page
+  uint8_t trimmed;     // whether the huge pages a free span covers entirely were; first page
+  uint8_t zeroed;      // whether a free span is known to read as zeroes; only set on its first page
+} span_t;
+
+//Every small and medium object lives in one range of address space, reserved the first time it
+//is needed, so whether the allocator owns a pointer is a check against the range's bounds. The
+//range is mapped a superblock at a time from its start. Each page has an entry in three side
+//tables indexed by page number: its size class in page_classes, which is all that free needs
+//and keeps sixty-four pages to a cache line, its header, and its span descriptor. The tables
+//are reserved inaccessible along with the range, and each superblock makes its own entries
+//accessible when it is mapped, so memory is only committed for the part of the heap in use.
+static char* heap_start = NULL;
+static char* heap_end = NULL;   // end of the mapped part, moved only once its entries are ready
+static size_t heap_mapped = 0;  // bytes mapped from the start of the range
+static uint8_t* page_classes = NULL;
+static page_header_t* page_headers = NULL;
+static span_t* spans = NULL;
+
+//Small-object pages and medium spans are both carved from superblocks, so a new page or span
+//normally costs no system call. Free spans of up to MAX_MEDIUM_PAGES pages are binned by exact
+//length; longer ones share the last bin. superblock_lock guards the mapped part of the heap and
+//the bins.
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t superblock_count = 0;
+static span_t* free_spans[MAX_MEDIUM_PAGES + 1];
+
+//In huge page mode, set by HUGE_PAGES_ENV_VAR, the heap range starts on a huge page boundary and
+//the kernel is asked to back it with transparent huge pages. Giving one 4 KiB page back would
+//split its huge page, so freed pages stay mapped and are only counted, in huge_page_used, one
+//entry per huge page of the range; a huge page is given back only once all of it is free.
+//Guarded by superblock_lock.
+static bool huge_pages = false;
+static uint16_t* huge_page_used = NULL;  // allocated pages in each huge page of the range
+static size_t huge_pages_in_use = 0;     // huge pages with at least one allocated page
+static uint64_t huge_page_released[HEAP_HUGE_PAGES / 64]; // one bit per huge page holding no memory
+
+//A large object's mapping. Large objects are page-aligned and carry no header, so their sizes
+//live in an open-addressing hash table keyed by address. They are mapped outside the heap range,
+//so they are never mistaken for small or medium objects.
+typedef struct large_entry_t {
+  uintptr_t address; // start of the mapping, 0 if the slot is empty
+  size_t size;       // bytes mapped, a multiple of PAGE_SIZE
+} large_entry_t;
+
+//The large object table and the cache of recently freed mappings, both guarded by large_lock
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static large_entry_t* large_table = NULL;
+static size_t large_table_capacity = 0;
+static size_t large_table_count = 0;
+static large_entry_t large_cache[LARGE_CACHE_ENTRIES]; // oldest entry first
+static size_t large_cache_count = 0;
+static size_t large_cache_bytes = 0;
+static size_t large_cache_aged = 0; // entries at the front that were cached at the last scavenge
+
+//An arena's objects that were too big for its spans, each allocated as a large object. The
+//entries themselves are allocated from the arena.
+typedef struct arena_large_t {
+  void* object;
+  struct arena_large_t* next;
+} arena_large_t;
+
+//An arena bump-allocates from spans of its own, whose pages are all marked PAGE_CLASS_ARENA. The
+//spans are linked through the headers of their first pages, which also hold their lengths in
+//bytes. Each object is preceded by a size_t holding its usable size; objects are 16-byte
+//aligned, so the bump pointer always sits 8 bytes past a multiple of 16, where the next
+//object's size goes.
+struct arena_t {
+  page_header_t* spans;   // the arena's spans, newest first
+  char* bump;             // where the next object's size goes in the newest span
+  char* end;              // the end of the newest span
+  uint32_t next_pages;    // the length of the next span the arena takes
+  arena_large_t* large;   // objects too big for a span
+};
+
+//Counters for medium and large objects. Those paths take a lock or make a system call anyway,
+//so shared atomic counters cost them little.
+static size_t medium_allocations[NUM_MEDIUM_CLASSES];
+static size_t medium_frees[NUM_MEDIUM_CLASSES];
+static size_t large_allocations = 0;
+static size_t large_frees = 0;
+static size_t large_live_bytes = 0;
+static size_t arena_bytes = 0; // bytes of spans held by arenas
+
+//Counters for the allocator's system calls and the memory it holds from the kernel
+static size_t mmap_calls = 0;
+static size_t munmap_calls = 0;
+static size_t mprotect_calls = 0; // superblocks and their table entries made accessible
+static size_t mremap_calls = 0;   // large objects resized in place or moved
+static size_t madvise_calls = 0;
+static size_t mapped_bytes = 0;   // bytes currently mapped, including cached and free memory
+static size_t released_bytes = 0; // bytes ever given back to the kernel with madvise
+
+//The background scavenger, started by SCAVENGE_ENV_VAR, wakes up now and then to give back
+//memory that has sat unused since its last pass. Threads shrink their own caches when they see
+//that a pass has happened, since no other thread may touch them. While it runs, each size class
+//keeps more empty pages, so a program that frees and reallocates in bursts does not refault
+//pages the allocator released a moment earlier.
+static bool scavenger_on = false;
+static size_t scavenger_passes = 0;
+static size_t scavenger_interval_ms = SCAVENGER_START_INTERVAL_MS;
+static size_t empty_pages_limit = EMPTY_PAGES_KEPT;
+
+//Every registered thread cache, so its counters can be summed, and the summed counters of
+//caches whose threads have exited. Guarded by stats_lock.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_cache_t* thread_caches = NULL;
+static size_t exited_allocations[NUM_SIZE_CLASSES];
+static size_t exited_frees[NUM_SIZE_CLASSES];
+
+//Whether STATS_ENV_VAR asked for the statistics to be dumped at exit
+static bool stats_at_exit = false;
+
+//A snapshot of every counter, with small, medium and large objects in one table
+typedef struct heap_stats_t {
+  size_t object_sizes[NUM_STATS_CLASSES];
+  size_t allocations[NUM_STATS_CLASSES];
+  size_t frees[NUM_STATS_CLASSES];
+  size_t pages[NUM_STATS_CLASSES]; // pages currently held by the class
+  bool complete;                   // false if the thread counters could not be read
+} heap_stats_t;
+
+//Used to flush a thread's cache back to the central pools when the thread exits
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// Every small size class, in increasing order. Sizes up to 128 bytes step by 16; above that
+// there are four classes per doubling, so rounding never wastes more than 25% of an object.
+#define SIZE_CLASS_LIST(X)                                                               \
+  X(16) X(32) X(48) X(64) X(80) X(96) X(112) X(128) X(160) X(192) X(224) X(256) X(320) \
+  X(384) X(448) X(512) X(640) X(768) X(896) X(1024) X(1280) X(1536) X(1792) X(2048)
+
+// The size class of a request of g 16-byte granules. This is a constant expression, so the
+// lookup table below is filled in by the compiler. Past 128 bytes, the top three bits of g - 1
+// pick the class: the leading one gives the doubling and the next two the quarter within it.
+#define GRANULE_LOG2(g) ((g) >= 64 ? 6 : (g) >= 32 ? 5 : (g) >= 16 ? 4 : 3)
+#define GRANULE_CLASS(g)           \
+  ((g) <= 8 ? ((g) == 0 ? 0 : (g) - 1) \
+            : 8 + (GRANULE_LOG2((g) - 1) - 3) * 4 + ((((g) - 1) >> (GRANULE_LOG2((g) - 1) - 2)) & 3))
+#define GRANULE_CLASSES_4(g) \
+  GRANULE_CLASS(g), GRANULE_CLASS((g) + 1), GRANULE_CLASS((g) + 2), GRANULE_CLASS((g) + 3)
+#define GRANULE_CLASSES_16(g)                                                  \
+  GRANULE_CLASSES_4(g), GRANULE_CLASSES_4((g) + 4), GRANULE_CLASSES_4((g) + 8), \
+      GRANULE_CLASSES_4((g) + 12)
+#define GRANULE_CLASSES_64(g)                                                       \
+  GRANULE_CLASSES_16(g), GRANULE_CLASSES_16((g) + 16), GRANULE_CLASSES_16((g) + 32), \
+      GRANULE_CLASSES_16((g) + 48)
+
+// Objects of a class are placed at a fixed stride from the start of the page, so every object is
+// aligned to the largest power of two dividing its size, and power-of-two sizes are naturally
+// aligned.
+#define CLASS_OBJECTS(size) (PAGE_SIZE / (size))
+
+// The number of objects moved between a thread cache and the central pool at once for objects
+// of a given size. A batch never spans more than one freshly carved page.
+#define CLASS_BATCH(size) (CLASS_OBJECTS(size) < MAX_BATCH_SIZE ? CLASS_OBJECTS(size) : MAX_BATCH_SIZE)
+
+#define CLASS_SIZE_ENTRY(size) size,
+#define CLASS_OBJECTS_ENTRY(size) CLASS_OBJECTS(size),
+#define CLASS_BATCH_ENTRY(size) CLASS_BATCH(size),
 
+//The size class of every small request, indexed by its size in 16-byte granules rounded up
+static const uint8_t size_classes[MAX_SMALL_SIZE / MIN_MALLOC_SIZE + 1] = {
+    GRANULE_CLASSES_64(0), GRANULE_CLASSES_64(64), GRANULE_CLASS(128)};
+
+_Static_assert(GRANULE_CLASS(MAX_SMALL_SIZE / MIN_MALLOC_SIZE) == NUM_SIZE_CLASSES - 1,
+               "SIZE_CLASS_LIST and GRANULE_CLASS disagree about the number of size classes");
+
+//The object size of each size class
+static const size_t class_sizes[NUM_SIZE_CLASSES] = {SIZE_CLASS_LIST(CLASS_SIZE_ENTRY)};
+
+//The number of objects in each size class's pages
+static const uint16_t class_objects[NUM_SIZE_CLASSES] = {SIZE_CLASS_LIST(CLASS_OBJECTS_ENTRY)};
+
+//The batch size of each size class
+static const uint8_t class_batch_sizes[NUM_SIZE_CLASSES] = {SIZE_CLASS_LIST(CLASS_BATCH_ENTRY)};
+
+// The span length, in pages, of every medium size class. Like the small classes these step by
+// one up to eight and then come four per doubling, so GRANULE_CLASS maps page counts to them.
+#define MEDIUM_CLASS_LIST(X)                                                                  \
+  X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(10) X(12) X(14) X(16) X(20) X(24) X(28) X(32) \
+  X(40) X(48) X(56) X(64)
+
+#define MEDIUM_PAGES_ENTRY(pages) pages,
+
+_Static_assert(GRANULE_CLASS(MAX_MEDIUM_PAGES) == NUM_MEDIUM_CLASSES - 1,
+               "MEDIUM_CLASS_LIST and GRANULE_CLASS disagree about the number of medium classes");
+
+//The medium size class of every span length, indexed by the number of pages a request needs
+static const uint8_t medium_classes[MAX_MEDIUM_PAGES + 1] = {GRANULE_CLASSES_64(0),
+                                                             GRANULE_CLASS(MAX_MEDIUM_PAGES)};
+
+//The span length of each medium size class
+static const uint8_t medium_class_pages[NUM_MEDIUM_CLASSES] = {MEDIUM_CLASS_LIST(MEDIUM_PAGES_ENTRY)};
+
+page_header_t* allocate_page(size_t size);
 
 /**
   * \brief This fucntion rounds the size up to power of two
@@ -49,15 +440,11 @@ free_object_t* freelists[8]; // 16, 32, 64, 128, 256, 512, 1024, 2048
   * \return size_t the round-up result
   */
 size_t round_up_to_power_of_two(size_t size) {
-    size_t power_of_two = 16; // Start with the smallest size class
-
-    //If the size is larger than the current power of two
-    //times the current power of two by two
-    while (size > power_of_two) {
-        power_of_two *= 2;
-    }
+  // Start with the smallest size class
+  if (size <= MIN_MALLOC_SIZE) return MIN_MALLOC_SIZE;
 
-    return power_of_two;
+  //The highest set bit of size - 1 is one below the power of two we want
+  return (size_t)1 << (sizeof(size_t) * 8 - __builtin_clzl(size - 1));
 }
 
 
@@ -67,17 +454,8 @@ size_t round_up_to_power_of_two(size_t size) {
   * \return size_t the round-up result
   */
 size_t round_up_to_multiple_of_page_size(size_t size) {
-    size_t multiple_of_page_size = PAGE_SIZE;
-    int i = 1;
-
-    //If the size is larger than the current power of two
-    //add page_size to the multiple_of_page_size
-    while (size > multiple_of_page_size) {
-      multiple_of_page_size = PAGE_SIZE*i;
-      i++;
-    }
-
-    return multiple_of_page_size;
+  //PAGE_SIZE is a power of two, so clearing the low bits rounds down
+  return (size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
 }
 
 
@@ -87,127 +465,2630 @@ size_t round_up_to_multiple_of_page_size(size_t size) {
   * \return int the corresponding index of freelist of that size in the freelist array
   */
 int size_to_index(size_t size) {
-    int sizes[] = {16, 32, 64, 128, 256, 512, 1024, 2048};
-    for (int i = 0; i < 8; i++) {
-        if (size <= sizes[i]) {
-            return i;
-        }
+  if (size > MAX_SMALL_SIZE) return -1; // size is too large
+  return size_classes[(size + MIN_MALLOC_SIZE - 1) / MIN_MALLOC_SIZE];
+}
+
+/**
+  * \brief The number of objects moved between a thread cache and the central pool at once
+  * \param index the size class
+  * \return size_t the batch size for that class
+  */
+size_t batch_size(int index) {
+  return class_batch_sizes[index];
+}
+
+
+/**
+  * \brief Find the size class of a small object allocated at an alignment. Small objects are
+  *        aligned to the largest power of two dividing their class size, so this is the first
+  *        class that is big enough and aligned enough. The 2048-byte class always is.
+  * \param size the size requested, at most MAX_SMALL_SIZE
+  * \param alignment the alignment requested, a power of two of at most MAX_SMALL_SIZE
+  * \return int the size class
+  */
+int aligned_size_to_index(size_t size, size_t alignment) {
+  int index = size_to_index(size);
+  while ((class_sizes[index] & -class_sizes[index]) < alignment) {
+    index++;
+  }
+  return index;
+}
+
+
+/**
+  * \brief Check whether a pointer is inside the heap range, where all small and medium objects
+  *        live. Anything else is a large object or not the allocator's at all.
+  * \param ptr any pointer
+  * \return bool true if the pointer is inside the heap range
+  */
+bool in_heap(void* ptr) {
+  //Read the end first: until it is set, no pointer passes whatever the start reads as
+  char* end = __atomic_load_n(&heap_end, __ATOMIC_ACQUIRE);
+  return (char*)ptr < end && (char*)ptr >= heap_start;
+}
+
+
+/**
+  * \brief Find the number of the page a pointer is in, counting from the start of the heap
+  * \param ptr a pointer inside the heap range
+  * \return size_t the page number, the index of the page's entries in the side tables
+  */
+size_t page_number(void* ptr) {
+  return ((char*)ptr - heap_start) / PAGE_SIZE;
+}
+
+
+/**
+  * \brief Find the header of the page an object lives in
+  * \param ptr a pointer into a small object, or into the first page of a medium object
+  * \return page_header_t* the page's header
+  */
+page_header_t* page_of(void* ptr) {
+  return &page_headers[page_number(ptr)];
+}
+
+
+/**
+  * \brief Find the page a header describes
+  * \param page a page header
+  * \return char* the start of the page
+  */
+char* page_address(page_header_t* page) {
+  return heap_start + (page - page_headers) * PAGE_SIZE;
+}
+
+
+/**
+  * \brief Allocate a new page for a size class. Only the side tables are written; the objects
+  *        are carved from the bump offset as they are needed. Caller holds the class's central lock.
+  * \param index the size class
+  * \return page_header_t* the new page, with no live objects
+  */
+page_header_t* allocate_class_page(int index) {
+  page_header_t* page = allocate_page(class_sizes[index]);
+  page->freelist = NULL;
+  page->live = 0;
+  page->bump = 0;
+  page->end = class_objects[index] * class_sizes[index];
+  page->owner = 0;
+  central_list_t* central = &central_lists[index];
+  central->pages_mapped++;
+  if (central->pages_mapped - central->pages_released > central->peak_pages) {
+    central->peak_pages = central->pages_mapped - central->pages_released;
+  }
+  page_classes[page - page_headers] = index + 1;
+  return page;
+}
+
+
+/**
+  * \brief Check whether a page can hand out another object
+  * \param page a small page
+  * \return bool true if the page has a freed object or a slot never handed out
+  */
+bool page_has_free(page_header_t* page) {
+  return page->freelist != NULL || page->bump < page->end;
+}
+
+
+/**
+  * \brief Put a page at the front of one of a size class's page lists. Caller holds the class's
+  *        central lock.
+  * \param list the head of the list
+  * \param page the page to add
+  */
+void page_list_push(page_header_t** list, page_header_t* page) {
+  page->prev = NULL;
+  page->next = *list;
+  if (*list != NULL) (*list)->prev = page;
+  *list = page;
+}
+
+
+/**
+  * \brief Take a page off one of a size class's page lists. Caller holds the class's central
+  *        lock.
+  * \param list the head of the list the page is on
+  * \param page the page to remove
+  */
+void page_list_remove(page_header_t** list, page_header_t* page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    *list = page->next;
+  }
+  if (page->next != NULL) page->next->prev = page->prev;
+}
+
+
+/**
+  * \brief Find the list a small page belongs on given its live objects and free slots
+  * \param central the page's size class's central list
+  * \param page the page
+  * \return page_header_t** the head of the list, or NULL for a full page, which is on none
+  */
+page_header_t** page_list_of(central_list_t* central, page_header_t* page) {
+  if (!page_has_free(page)) return NULL;
+  if (page->live == 0) return &central->empty;
+  //A partly used page has between one and one fewer than all of its slots in use
+  int index = central - central_lists;
+  return &central->partial[page->live * FULLNESS_BUCKETS / class_objects[index]];
+}
+
+
+/**
+  * \brief Move a page to the list it now belongs on, after its live count changed
+  * \param central the page's size class's central list
+  * \param page the page
+  * \param list the list the page was on, or NULL if it was full
+  */
+void page_list_update(central_list_t* central, page_header_t* page, page_header_t** list) {
+  page_header_t** now = page_list_of(central, page);
+  if (now == list) return;
+  if (list != NULL) page_list_remove(list, page);
+  if (now != NULL) page_list_push(now, page);
+}
+
+
+/**
+  * \brief Find the page a size class should hand out objects from next: the fullest partly used
+  *        page, or else the most recently emptied page
+  * \param central the size class's central list
+  * \return page_header_t* the page, or NULL if the class has no page with a free object
+  */
+page_header_t* fullest_page(central_list_t* central) {
+  for (int bucket = FULLNESS_BUCKETS - 1; bucket >= 0; bucket--) {
+    if (central->partial[bucket] != NULL) return central->partial[bucket];
+  }
+  return central->empty;
+}
+
+
+/**
+  * \brief Map fresh anonymous memory, counting the call and the bytes mapped
+  * \param size the number of bytes to map
+  * \return void* the mapping, or MAP_FAILED
+  */
+void* map_memory(size_t size) {
+  void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  STAT_ADD(mmap_calls, 1);
+  if (block != MAP_FAILED) STAT_ADD(mapped_bytes, size);
+  return block;
+}
+
+
+/**
+  * \brief Unmap memory, counting the call and the bytes unmapped
+  * \param start the start of the memory
+  * \param size the number of bytes to unmap
+  */
+void unmap_memory(void* start, size_t size) {
+  munmap(start, size);
+  STAT_ADD(munmap_calls, 1);
+  STAT_SUB(mapped_bytes, size);
+}
+
+
+/**
+  * \brief Give the pages of some memory back to the kernel while keeping them mapped. They read
+  *        as zeroes when next touched.
+  * \param start the start of the memory, page-aligned
+  * \param size the number of bytes to release, a multiple of PAGE_SIZE
+  */
+void release_memory(void* start, size_t size) {
+  madvise(start, size, MADV_DONTNEED);
+  STAT_ADD(madvise_calls, 1);
+  STAT_ADD(released_bytes, size);
+}
+
+
+/**
+  * \brief Let the kernel take back the pages of some memory when it needs them, which costs it
+  *        nothing until then. Pages it has not taken keep their contents; the rest read as
+  *        zeroes. Falls back to release_memory on kernels without MADV_FREE.
+  * \param start the start of the memory, page-aligned
+  * \param size the number of bytes to release, a multiple of PAGE_SIZE
+  */
+void release_memory_lazily(void* start, size_t size) {
+  if (madvise(start, size, MADV_FREE) != 0) {
+    release_memory(start, size);
+    return;
+  }
+  STAT_ADD(madvise_calls, 1);
+  STAT_ADD(released_bytes, size);
+}
+
+
+/**
+  * \brief Find the descriptor of the span starting at an address
+  * \param start the start of a span
+  * \return span_t* the descriptor of the span's first page
+  */
+span_t* span_of(void* start) {
+  return &spans[page_number(start)];
+}
+
+
+/**
+  * \brief Find the first page of a span
+  * \param span the descriptor of the span's first page
+  * \return void* the start of the span
+  */
+void* span_start(span_t* span) {
+  return heap_start + (span - spans) * PAGE_SIZE;
+}
+
+
+/**
+  * \brief Record a span's length and state in the descriptors of its first and last pages
+  * \param span the descriptor of the span's first page
+  * \param pages the length of the span
+  * \param free whether the span is free
+  */
+void span_mark(span_t* span, uint32_t pages, bool free) {
+  span->pages = pages;
+  span->free = free;
+  span[pages - 1].pages = pages;
+  span[pages - 1].free = free;
+}
+
+
+/**
+  * \brief Add a free span to the bin for its length. Caller holds superblock_lock.
+  * \param span the descriptor of the span's first page
+  */
+void span_bin_insert(span_t* span) {
+  span_t** bin = &free_spans[span->pages < MAX_MEDIUM_PAGES ? span->pages : MAX_MEDIUM_PAGES];
+  span->prev = NULL;
+  span->next = *bin;
+  if (*bin != NULL) (*bin)->prev = span;
+  *bin = span;
+}
+
+
+/**
+  * \brief Take a free span out of its bin. Caller holds superblock_lock.
+  * \param span the descriptor of the span's first page
+  */
+void span_bin_remove(span_t* span) {
+  if (span->prev != NULL) {
+    span->prev->next = span->next;
+  } else {
+    free_spans[span->pages < MAX_MEDIUM_PAGES ? span->pages : MAX_MEDIUM_PAGES] = span->next;
+  }
+  if (span->next != NULL) span->next->prev = span->prev;
+}
+
+
+/**
+  * \brief Count pages allocated or freed in the huge pages they cover, in huge page mode.
+  *        Caller holds superblock_lock.
+  * \param span the descriptor of the first page
+  * \param pages the number of pages
+  * \param allocated true if the pages were just allocated, false if they are being freed
+  */
+void count_huge_page_use(span_t* span, uint32_t pages, bool allocated) {
+  if (!huge_pages) return;
+
+  size_t page = span - spans;
+  size_t end = page + pages;
+  while (page < end) {
+    size_t huge = page / HUGE_PAGE_PAGES;
+    size_t stop = (huge + 1) * HUGE_PAGE_PAGES < end ? (huge + 1) * HUGE_PAGE_PAGES : end;
+    if (allocated) {
+      if (huge_page_used[huge] == 0) {
+        STAT_ADD(huge_pages_in_use, 1);
+        huge_page_released[huge / 64] &= ~(1UL << (huge % 64));
+      }
+      huge_page_used[huge] += stop - page;
+    } else {
+      huge_page_used[huge] -= stop - page;
+      if (huge_page_used[huge] == 0) STAT_SUB(huge_pages_in_use, 1);
     }
-    return -1; // size is too large
+    page = stop;
+  }
 }
 
+
 /**
- * Allocate space on the heap.
- * \param size  The minimium number of bytes that must be allocated
- * \returns     A pointer to the beginning of the allocated space.
- *              This function may return NULL when an error occurs.
- */
-void* xxmalloc(size_t size) {
-  //Rounding up the object size
-  if (size <= MAX_SMALL_SIZE){
-    size = round_up_to_power_of_two(size);
-  }else{
-    size = round_up_to_multiple_of_page_size(size);
+  * \brief Reserve the heap range and its side tables. Nothing is backed by memory yet: both
+  *        stay inaccessible until superblocks are mapped in the range. Caller holds
+  *        superblock_lock.
+  */
+void reserve_heap(void) {
+  //Read here rather than in a constructor, since the heap may be needed before constructors run
+  char* mode = getenv(HUGE_PAGES_ENV_VAR);
+  huge_pages = mode != NULL && strcmp(mode, "1") == 0;
+
+  //Huge page mode reserves one huge page extra, so the range can start on a boundary
+  size_t reserve_size = HEAP_RESERVE_SIZE + (huge_pages ? HUGE_PAGE_SIZE : 0);
+  size_t table_bytes = HEAP_PAGES * (sizeof(uint8_t) + sizeof(page_header_t) + sizeof(span_t)) +
+                       HEAP_HUGE_PAGES * sizeof(uint16_t);
+  char* range = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0);
+  char* tables = mmap(NULL, table_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
+  STAT_ADD(mmap_calls, 2);
+  if (range == MAP_FAILED || tables == MAP_FAILED) {
+    log_message("Reserving the heap failed! Giving up.\n");
+    exit(2);
   }
+  if (huge_pages) range = (char*)ROUND_UP((uintptr_t)range, HUGE_PAGE_SIZE);
 
-  //Finding the corresponding index of freelist corresponding of the size
-  int index = size_to_index(size);
+  //The wider entries go first so every table stays aligned
+  page_headers = (page_header_t*)tables;
+  spans = (span_t*)(page_headers + HEAP_PAGES);
+  huge_page_used = (uint16_t*)(spans + HEAP_PAGES);
+  page_classes = (uint8_t*)(huge_page_used + HEAP_HUGE_PAGES);
+  heap_start = range;
+}
 
-  //Case 1: The rounded-up size is larger than 2048
-  if (size > MAX_SMALL_SIZE) {
-    //directly allocate the memory
-    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (block == MAP_FAILED) {
-      log_message("mmap failed! Giving up.\n");
-      exit(2);
+
+/**
+  * \brief Make a run of side-table entries accessible
+  * \param start the first entry
+  * \param bytes the length of the run
+  */
+void commit_table(void* start, size_t bytes) {
+  //The run is widened to whole pages, which may already be shared with the previous superblock
+  uintptr_t first = (uintptr_t)start - (uintptr_t)start % PAGE_SIZE;
+  uintptr_t last = ROUND_UP((uintptr_t)start + bytes, PAGE_SIZE);
+  if (mprotect((void*)first, last - first, PROT_READ | PROT_WRITE) != 0) {
+    log_message("mprotect failed! Giving up.\n");
+    exit(2);
+  }
+  STAT_ADD(mprotect_calls, 1);
+}
+
+
+/**
+  * \brief Map the next superblock of the heap range and put all of it into the free-span bins.
+  *        Caller holds superblock_lock.
+  */
+void add_superblock(void) {
+  if (heap_start == NULL) reserve_heap();
+  if (heap_mapped == HEAP_RESERVE_SIZE) {
+    log_message("The heap is full! Giving up.\n");
+    exit(2);
+  }
+
+  char* start = heap_start + heap_mapped;
+  if (mprotect(start, SUPERBLOCK_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    log_message("mprotect failed! Giving up.\n");
+    exit(2);
+  }
+  STAT_ADD(mprotect_calls, 1);
+  STAT_ADD(mapped_bytes, SUPERBLOCK_SIZE);
+
+  size_t page = heap_mapped / PAGE_SIZE;
+  size_t huge = heap_mapped / HUGE_PAGE_SIZE;
+  commit_table(page_headers + page, SUPERBLOCK_PAGES * sizeof(page_header_t));
+  commit_table(spans + page, SUPERBLOCK_PAGES * sizeof(span_t));
+  commit_table(huge_page_used + huge, SUPERBLOCK_SIZE / HUGE_PAGE_SIZE * sizeof(uint16_t));
+  commit_table(page_classes + page, SUPERBLOCK_PAGES * sizeof(uint8_t));
+  //Superblocks are a whole number of huge pages, so in huge page mode each one starts on a
+  //boundary and can be backed entirely by huge pages
+  if (huge_pages) {
+    madvise(start, SUPERBLOCK_SIZE, MADV_HUGEPAGE);
+    STAT_ADD(madvise_calls, 1);
+    //Nothing has touched the new huge pages, so trimming has nothing to give back from them
+    for (size_t i = 0; i < SUPERBLOCK_SIZE / HUGE_PAGE_SIZE; i++) {
+      huge_page_released[(huge + i) / 64] |= 1UL << ((huge + i) % 64);
     }
-    return block;
   }
+  heap_mapped += SUPERBLOCK_SIZE;
+  superblock_count++;
+  __atomic_store_n(&heap_end, heap_start + heap_mapped, __ATOMIC_RELEASE);
 
-  //Case 2: The rounded-up size is smaller than or equal to 2048
-  //Checking whether we initialize the corresponding freelist
-  if (freelists[index] != NULL) {
-    free_object_t* obj = freelists[index];
-    freelists[index] = obj->next;
-    return (void*)obj;
-  }
-  else {
-    //Assigning space for the freelist
-    void* block = mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (block == MAP_FAILED) {
-      log_message("mmap failed! Giving up.\n");
-      exit(2);
-    }
-
-    //Create the header block at the head of the allocated space
-    page_header_t* header = (page_header_t*)block;
-    header->magic = MAGIC_NUMBER;
-    header->object_size = size;
-
-    //Calculate the avaliable blocks in the page and create the free list
-    int num_objects = (PAGE_SIZE - size) / size; //Calculate number of blocks can be created without the header
-    free_object_t* prev = NULL;
-    for (int i = 0; i < num_objects; i++) {
-      //skip the header plus the addtional i blocks ahead
-      free_object_t* obj = (free_object_t*)((char*)block + size + i * size);
-      if (prev) {
-        prev->next = obj; //build up the list
-      } else {
-        freelists[index] = obj; //link the freelist to the freelist arrau
-      }
-      prev = obj;
+  span_t* span = span_of(start);
+  span_mark(span, SUPERBLOCK_PAGES, true);
+  span->zeroed = true;
+  span->released = true;
+  span_bin_insert(span);
+}
+
+
+/**
+  * \brief Allocate a run of contiguous pages from the smallest bin that can hold it, splitting
+  *        off and re-binning whatever is left over
+  * \param pages the length of the span
+  * \param zeroed if not NULL, set to whether the span is known to read as zeroes
+  * \return void* the start of the span
+  */
+void* allocate_span(uint32_t pages, bool* zeroed) {
+  pthread_mutex_lock(&superblock_lock);
+
+  span_t* span = NULL;
+  for (uint32_t bin = pages; bin <= MAX_MEDIUM_PAGES && span == NULL; bin++) {
+    span = free_spans[bin];
+  }
+  if (span == NULL) {
+    add_superblock();
+    span = free_spans[MAX_MEDIUM_PAGES];
+  }
+  //Spans in the last bin can cover whole free huge pages. Carving from the lowest one keeps
+  //allocated pages packed into as few huge pages as possible.
+  if (huge_pages && span->pages >= MAX_MEDIUM_PAGES) {
+    for (span_t* other = span->next; other != NULL; other = other->next) {
+      if (other < span) span = other;
     }
+  }
+  span_bin_remove(span);
+
+  //Give back the tail of a longer span
+  if (span->pages > pages) {
+    span_t* rest = span + pages;
+    span_mark(rest, span->pages - pages, true);
+    rest->zeroed = span->zeroed;
+    rest->released = span->released;
+    rest->trimmed = span->trimmed;
+    span_bin_insert(rest);
+  }
+  span_mark(span, pages, false);
+  if (zeroed != NULL) *zeroed = span->zeroed;
+  count_huge_page_use(span, pages, true);
+
+  pthread_mutex_unlock(&superblock_lock);
+  return span_start(span);
+}
+
+
+/**
+  * \brief Return a span to the free-span bins, merging it with free neighbours on either side
+  * \param start the start of the span
+  * \param zeroed whether the span's pages are known to read as zeroes, which also means that
+  *        they hold no memory
+  */
+void free_span(void* start, bool zeroed) {
+  span_t* span = span_of(start);
+  bool released = zeroed;
+
+  pthread_mutex_lock(&superblock_lock);
+
+  uint32_t pages = span->pages;
+  count_huge_page_use(span, pages, false);
 
-    if (prev) {
-      prev->next = NULL;
+  //The page before the span is the last page of the previous span. Superblocks are mapped one
+  //after another, so spans merge across their boundaries.
+  span_t* before = span - 1;
+  if (span > spans && before->free) {
+    span_t* previous = before - (before->pages - 1);
+    span_bin_remove(previous);
+    pages += previous->pages;
+    zeroed = zeroed && previous->zeroed;
+    released = released && previous->released;
+    span = previous;
+  }
+
+  //The page after the span is the first page of the next span, unless the span ends the mapped
+  //part of the heap, where the next descriptor may not be accessible yet
+  span_t* after = span + pages;
+  if (after < spans + heap_mapped / PAGE_SIZE && after->free) {
+    span_bin_remove(after);
+    pages += after->pages;
+    zeroed = zeroed && after->zeroed;
+    released = released && after->released;
+  }
+
+  span_mark(span, pages, true);
+  span->zeroed = zeroed;
+  span->released = released;
+  //Pages either side of a join may now make up a whole huge page, so it has to be looked at again
+  span->trimmed = false;
+  span_bin_insert(span);
+
+  pthread_mutex_unlock(&superblock_lock);
+}
+
+
+/**
+  * \brief Change the length of an allocated span without moving it. Shrinking frees the tail;
+  *        growing takes pages from the front of a free span that directly follows it.
+  * \param start the start of the span
+  * \param pages the length wanted
+  * \return bool true if the span now has the requested length
+  */
+bool resize_span(void* start, uint32_t pages) {
+  span_t* span = span_of(start);
+
+  pthread_mutex_lock(&superblock_lock);
+
+  uint32_t old_pages = span->pages;
+  if (pages < old_pages) {
+    //Split off the tail as an allocated span, then free it so it merges with what follows
+    span_mark(span, pages, false);
+    span_mark(span + pages, old_pages - pages, false);
+    pthread_mutex_unlock(&superblock_lock);
+    free_span((char*)start + (size_t)pages * PAGE_SIZE, false);
+    return true;
+  }
+
+  if (pages > old_pages) {
+    span_t* after = span + old_pages;
+    if (after >= spans + heap_mapped / PAGE_SIZE || !after->free ||
+        old_pages + after->pages < pages) {
+      pthread_mutex_unlock(&superblock_lock);
+      return false;
     }
 
-    //Get the first element of the corresponding freelist
-    free_object_t* obj = freelists[index];
-    freelists[index] = obj->next; //delete it from the freelist
-    return (void*)obj;
+    //Absorb the front of the following free span and re-bin whatever is left of it
+    span_bin_remove(after);
+    uint32_t spare = old_pages + after->pages - pages;
+    span_mark(span, pages, false);
+    count_huge_page_use(after, pages - old_pages, true);
+    if (spare > 0) {
+      span_mark(span + pages, spare, true);
+      span[pages].zeroed = after->zeroed;
+      span[pages].released = after->released;
+      span[pages].trimmed = after->trimmed;
+      span_bin_insert(span + pages);
+    }
   }
+
+  pthread_mutex_unlock(&superblock_lock);
+  return true;
 }
 
+
 /**
- * Free space occupied by a heap object.
- * \param ptr   A pointer somewhere inside the object that is being freed
- */
-void xxfree(void* ptr) {
-  //determine which block-size that this ptr belongs to
-  size_t size = xxmalloc_usable_size(ptr);
+  * \brief Allocate a one-page span for a size class and fill in its BiBoP header
+  * \param size the object size stored in the header
+  * \return page_header_t* the page's header
+  */
+page_header_t* allocate_page(size_t size) {
+  page_header_t* header = page_of(allocate_span(1, NULL));
+  header->object_size = size;
+  return header;
+}
 
-  //We use xxmalloc_usable_size to check if ptr is NULL or the magic number does not match
-  //If size is 0, then return nothing
-  if (size==0) return;
 
-  //transit to freelist index
-  int index = size_to_index(size);
-  //get the block
-  free_object_t* obj = (free_object_t*)ptr;
-  //put it back to freelist
-  obj->next = freelists[index];
-  freelists[index] = obj;
+/**
+  * \brief Allocate a medium object as a whole span of its size class's length
+  * \param size the requested size, at most MAX_MEDIUM_SIZE
+  * \param zeroed if not NULL, set to whether the object is known to read as zeroes
+  * \return void* the start of the object
+  */
+void* allocate_medium(size_t size, bool* zeroed) {
+  int index = medium_classes[(size + PAGE_SIZE - 1) / PAGE_SIZE];
+  size_t pages = medium_class_pages[index];
+  char* block = allocate_span(pages, zeroed);
 
+  //The first page's header looks just like a small page's, so the same lookup finds the size
+  page_header_t* header = page_of(block);
+  header->object_size = pages * PAGE_SIZE;
+  page_classes[page_number(block)] = PAGE_CLASS_MEDIUM;
+  STAT_ADD(medium_allocations[index], 1);
+  return block;
 }
 
+
 /**
- * Get the available size of an allocated object. This function should return the amount of space
+  * \brief Find the medium size class of an allocated medium object
+  * \param header the header of the object's first page
+  * \return int the medium size class
+  */
+int medium_class_of(page_header_t* header) {
+  return medium_classes[header->object_size / PAGE_SIZE];
+}
+
+
+/**
+  * \brief Free a medium object, returning its span to the span heap
+  * \param header the header of the object's first page
+  */
+void free_medium(page_header_t* header) {
+  STAT_ADD(medium_frees[medium_class_of(header)], 1);
+
+  //Forget the class so a stale pointer into the span is no longer taken for an object
+  page_classes[header - page_headers] = 0;
+  free_span(page_address(header), false);
+}
+
+
+/**
+  * \brief Resize a medium object in place by resizing its span to the new size's class
+  * \param header the header of the object's first page
+  * \param size the new size, more than MAX_SMALL_SIZE and at most MAX_MEDIUM_SIZE
+  * \return bool true if the object now holds size bytes without having moved
+  */
+bool resize_medium(page_header_t* header, size_t size) {
+  int index = medium_classes[(size + PAGE_SIZE - 1) / PAGE_SIZE];
+  size_t pages = medium_class_pages[index];
+  int old_index = medium_class_of(header);
+  if (!resize_span(page_address(header), pages)) return false;
+
+  //Count the resize as freeing an object of the old class and allocating one of the new
+  header->object_size = pages * PAGE_SIZE;
+  STAT_ADD(medium_frees[old_index], 1);
+  STAT_ADD(medium_allocations[index], 1);
+  return true;
+}
+
+
+/**
+  * \brief Find how many empty pages a size class keeps for reuse: a share of its peak, bounded
+  *        by EMPTY_BYTES_KEPT, and never fewer than empty_pages_limit
+  * \param central the size class's central list
+  * \return size_t the number of empty pages to keep
+  */
+size_t empty_pages_reserve(central_list_t* central) {
+  size_t reserve = central->peak_pages / EMPTY_PAGES_PEAK_FRACTION;
+  if (reserve > EMPTY_BYTES_KEPT / PAGE_SIZE) reserve = EMPTY_BYTES_KEPT / PAGE_SIZE;
+  return reserve > empty_pages_limit ? reserve : empty_pages_limit;
+}
+
+
+/**
+  * \brief Give the empty pages of a size class beyond the first keep on its empty list, which
+  *        are the ones that have been empty longest, back to the kernel and to the span heap.
+  *        Pages that lie next to each other go back in one madvise call. Caller holds the size
+  *        class's central lock.
+  * \param central the size class's central list
+  * \param keep the number of the most recently emptied pages to keep
+  * \return size_t the number of pages released
+  */
+size_t release_empty_pages(central_list_t* central, size_t keep) {
+  page_header_t* page = central->empty;
+  for (size_t i = 0; i < keep && page != NULL; i++) {
+    page = page->next;
+  }
+  if (page == NULL) return 0;
+
+  //Cut the pages to release off the end of the list
+  if (page->prev != NULL) {
+    page->prev->next = NULL;
+  } else {
+    central->empty = NULL;
+  }
+
+  size_t released = 0;
+  while (page != NULL) {
+    //Sort a batch of pages by address. Page headers are in the same order as their pages.
+    page_header_t* batch[EMPTY_PAGES_RELEASE_BATCH];
+    size_t count = 0;
+    for (; page != NULL && count < EMPTY_PAGES_RELEASE_BATCH; page = page->next) {
+      size_t slot = count++;
+      while (slot > 0 && batch[slot - 1] > page) {
+        batch[slot] = batch[slot - 1];
+        slot--;
+      }
+      batch[slot] = page;
+    }
+
+    for (size_t first = 0; first < count;) {
+      size_t run = 1;
+      while (first + run < count && batch[first + run] == batch[first] + run) run++;
+
+      //In huge page mode the pages stay mapped; they are counted free in their huge pages
+      //instead. Otherwise the kernel drops their contents and refaults them as zeroes.
+      if (!huge_pages) release_memory(page_address(batch[first]), run * PAGE_SIZE);
+      for (size_t i = first; i < first + run; i++) {
+        page_classes[batch[i] - page_headers] = 0;
+        free_span(page_address(batch[i]), !huge_pages);
+      }
+      first += run;
+    }
+    released += count;
+  }
+
+  central->empty_pages -= released;
+  central->pages_released += released;
+  return released;
+}
+
+
+/**
+  * \brief Give an arena a new span to bump-allocate from, big enough for one object
+  * \param arena the arena
+  * \param usable the usable size of the object the span must hold
+  */
+void arena_add_span(arena_t* arena, size_t usable) {
+  //Room for the object, its size, and the 8 bytes skipped at the start to align it
+  uint32_t pages = (usable + 2 * sizeof(size_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+  if (pages < arena->next_pages) pages = arena->next_pages;
+  if (arena->next_pages < MAX_MEDIUM_PAGES) arena->next_pages *= 2;
+
+  char* start = allocate_span(pages, NULL);
+  memset(page_classes + page_number(start), PAGE_CLASS_ARENA, pages);
+  STAT_ADD(arena_bytes, (size_t)pages * PAGE_SIZE);
+
+  page_header_t* header = page_of(start);
+  header->object_size = pages * PAGE_SIZE;
+  header->next = arena->spans;
+  arena->spans = header;
+  arena->bump = start + sizeof(size_t);
+  arena->end = start + (size_t)pages * PAGE_SIZE;
+}
+
+
+/**
+  * \brief Return one object to its page, moving the page to the list for its new fullness.
+  *        Caller holds the size class's central lock. A page left with no live objects goes on
+  *        the empty list for reuse. Once that list holds twice the class's reserve, the pages
+  *        beyond the reserve are released together, so a class that empties and refills its
+  *        pages over and over does not release and refault them every time.
+  * \param central the size class's central list
+  * \param obj the object being returned
+  */
+void return_object(central_list_t* central, free_object_t* obj) {
+  page_header_t* page = page_of(obj);
+  page_header_t** list = page_list_of(central, page);
+
+  obj->next = page->freelist;
+  page->freelist = obj;
+  page->live--;
+  page_list_update(central, page, list);
+  if (page->live != 0) return;
+
+  central->empty_pages++;
+  size_t reserve = empty_pages_reserve(central);
+  if (central->empty_pages > 2 * reserve) release_empty_pages(central, reserve);
+}
+
+
+/**
+  * \brief Return a chain of objects of one size class to their pages
+  * \param index the size class
+  * \param head the first object of a NULL-terminated chain
+  */
+void return_objects(int index, free_object_t* head) {
+  central_list_t* central = &central_lists[index];
+  pthread_mutex_lock(&central->lock);
+  while (head != NULL) {
+    free_object_t* next = head->next;
+    return_object(central, head);
+    head = next;
+  }
+  pthread_mutex_unlock(&central->lock);
+}
+
+
+/**
+  * \brief Send a chain of objects to the thread that owns their page, without taking a lock
+  * \param list the owner's remote free list
+  * \param head the first object of the chain
+  * \param tail the last object of the chain
+  */
+void push_remote_frees(remote_list_t* list, free_object_t* head, free_object_t* tail) {
+  free_object_t* old = __atomic_load_n(&list->head, __ATOMIC_RELAXED);
+  do {
+    tail->next = old;
+  } while (!__atomic_compare_exchange_n(&list->head, &old, head, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+
+/**
+  * \brief Send the objects in a chain whose pages other running threads own back to those
+  *        threads. Neighbouring objects with the same owner go in one push.
+  * \param cache the calling thread's cache
+  * \param head the first object of a NULL-terminated chain
+  * \return free_object_t* the objects left over, which belong in the central pool
+  */
+free_object_t* send_remote_frees(thread_cache_t* cache, free_object_t* head) {
+  free_object_t* kept = NULL;
+  free_object_t* run_head = NULL;
+  free_object_t* run_tail = NULL;
+  uint16_t run_owner = 0;
+
+  while (head != NULL) {
+    free_object_t* obj = head;
+    head = obj->next;
+
+    uint16_t owner = __atomic_load_n(&page_of(obj)->owner, __ATOMIC_RELAXED);
+    if (owner == cache->owner || owner == 0 ||
+        !__atomic_load_n(&remote_lists[owner].active, __ATOMIC_RELAXED)) {
+      obj->next = kept;
+      kept = obj;
+      continue;
+    }
+
+    if (owner != run_owner) {
+      if (run_head != NULL) push_remote_frees(&remote_lists[run_owner], run_head, run_tail);
+      run_head = NULL;
+      run_tail = obj;
+      run_owner = owner;
+    }
+    obj->next = run_head;
+    run_head = obj;
+  }
+  if (run_head != NULL) push_remote_frees(&remote_lists[run_owner], run_head, run_tail);
+
+  return kept;
+}
+
+
+/**
+  * \brief Return objects from a thread cache list that has grown too long, sending those from
+  *        other threads' pages back to their owners
+  * \param cache the calling thread's cache
+  * \param index the size class to trim
+  * \param count the number of objects to return, at least one and at most the list's length
+  */
+void flush_thread_cache_batch(thread_cache_t* cache, int index, size_t count) {
+  //Detach the first count objects from the thread's list
+  free_object_t* head = cache->freelists[index];
+  free_object_t* tail = head;
+  for (size_t i = 1; i < count; i++) {
+    tail = tail->next;
+  }
+  cache->freelists[index] = tail->next;
+  cache->counts[index] -= count;
+  tail->next = NULL;
+
+  head = send_remote_frees(cache, head);
+  if (head != NULL) return_objects(index, head);
+}
+
+
+/**
+  * \brief Return every object in the calling thread's cache to the central pools
+  * \param cache the thread cache to empty
+  */
+void flush_thread_cache(thread_cache_t* cache) {
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    if (cache->freelists[index] == NULL) continue;
+
+    return_objects(index, cache->freelists[index]);
+    cache->freelists[index] = NULL;
+    cache->counts[index] = 0;
+  }
+}
+
+
+/**
+  * \brief Cut every list in a thread cache that holds more than two batches back to one batch,
+  *        returning the rest in a single chain per size class
+  * \param cache the calling thread's cache
+  */
+void flush_long_thread_cache_lists(thread_cache_t* cache) {
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    if (cache->counts[index] > 2 * batch_size(index)) {
+      flush_thread_cache_batch(cache, index, cache->counts[index] - batch_size(index));
+    }
+  }
+}
+
+
+/**
+  * \brief Return half of every list in a thread cache, rounded up, once the scavenger has made
+  *        a pass since the cache last shrank. Lists the thread stops using drain away over
+  *        successive passes, while a list in use refills at its next slow path.
+  * \param cache the calling thread's cache
+  */
+void shrink_thread_cache(thread_cache_t* cache) {
+  size_t pass = STAT_READ(scavenger_passes);
+  if (cache->scavenger_pass == pass) return;
+
+  cache->scavenger_pass = pass;
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    if (cache->counts[index] > 0) {
+      flush_thread_cache_batch(cache, index, (cache->counts[index] + 1) / 2);
+    }
+  }
+}
+
+
+/**
+  * \brief Take every object other threads have sent to a remote free list and put it in a
+  *        thread cache, returning batches to the central pools from lists that grow too long
+  * \param cache the calling thread's cache
+  * \param list the remote free list to empty
+  */
+void drain_remote_frees(thread_cache_t* cache, remote_list_t* list) {
+  //Look before swapping, so an empty list costs no locked instruction
+  if (__atomic_load_n(&list->head, __ATOMIC_RELAXED) == NULL) return;
+  free_object_t* obj = __atomic_exchange_n(&list->head, NULL, __ATOMIC_ACQUIRE);
+
+  while (obj != NULL) {
+    free_object_t* next = obj->next;
+    int index = page_classes[page_number(obj)] - 1;
+    obj->next = cache->freelists[index];
+    cache->freelists[index] = obj;
+    cache->counts[index]++;
+    obj = next;
+  }
+
+  flush_long_thread_cache_lists(cache);
+}
+
+
+/**
+  * \brief Give the calling thread a remote free list of its own, adopting one left by an exited
+  *        thread if there is one
+  * \return uint16_t the list's index, or 0 if every list is taken
+  */
+uint16_t acquire_remote_list(void) {
+  for (uint16_t owner = 1; owner < MAX_PAGE_OWNERS; owner++) {
+    bool active = false;
+    if (!__atomic_load_n(&remote_lists[owner].active, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&remote_lists[owner].active, &active, true, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return owner;
+    }
+  }
+  return 0;
+}
+
+
+/**
+  * \brief Count objects that a thread allocated or freed after its cache was torn down, with
+  *        those of threads that have exited
+  * \param index the size class
+  * \param allocations the number of objects allocated
+  * \param frees the number of objects freed
+  */
+void count_exited_objects(int index, size_t allocations, size_t frees) {
+  pthread_mutex_lock(&stats_lock);
+  exited_allocations[index] += allocations;
+  exited_frees[index] += frees;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+
+/**
+  * \brief Destructor for thread_cache_key, run when a thread that used the allocator exits
+  * \param arg the exiting thread's cache
+  */
+void thread_cache_destroy(void* arg) {
+  thread_cache_t* cache = (thread_cache_t*)arg;
+
+  //Stop other threads sending objects here, then take the ones they already sent. Anything sent
+  //in between waits for the thread that adopts the list next.
+  if (cache->owner != 0) {
+    remote_list_t* list = &remote_lists[cache->owner];
+    cache->owner = 0;
+    __atomic_store_n(&list->active, false, __ATOMIC_RELEASE);
+    drain_remote_frees(cache, list);
+  }
+  flush_thread_cache(cache);
+
+  //Keep the thread's counts, since its cache is about to go away
+  pthread_mutex_lock(&stats_lock);
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    exited_allocations[index] += cache->allocations[index];
+    exited_frees[index] += cache->frees[index];
+    __atomic_store_n(&cache->allocations[index], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->frees[index], 0, __ATOMIC_RELAXED);
+  }
+  if (cache->prev != NULL) {
+    cache->prev->next = cache->next;
+  } else {
+    thread_caches = cache->next;
+  }
+  if (cache->next != NULL) cache->next->prev = cache->prev;
+  pthread_mutex_unlock(&stats_lock);
+
+  //Later calls from other destructors bypass the cache. Registering it again would put it back
+  //on thread_caches and claim a remote list, and neither would be undone once the thread's
+  //storage is gone.
+  cache->registered = false;
+  cache->torn_down = true;
+}
+
+
+/**
+  * \brief Create the key whose destructor empties a thread's cache on exit
+  */
+void create_thread_cache_key(void) {
+  pthread_key_create(&thread_cache_key, thread_cache_destroy);
+}
+
+
+/**
+  * \brief Map the per-CPU caches if PER_CPU_ENV_VAR asks for them. Run once, by the first thread
+  *        to register its cache.
+  */
+void create_cpu_caches(void) {
+#ifdef CPU_CACHES_SUPPORTED
+  //Read here rather than in a constructor, since threads may register before constructors run
+  char* mode = getenv(PER_CPU_ENV_VAR);
+  if (mode == NULL || strcmp(mode, "1") != 0) return;
+
+  void* block = map_memory(MAX_CPUS * sizeof(cpu_cache_t));
+  if (block != MAP_FAILED) cpu_caches = (cpu_cache_t*)block;
+#endif
+}
+
+
+/**
+  * \brief Find the calling thread's rseq area, registering one with the kernel if the C library
+  *        has not
+  * \return struct rseq* the area, or NULL if the thread has none and registration failed
+  */
+struct rseq* thread_rseq(void) {
+#ifdef CPU_CACHES_SUPPORTED
+  //The kernel allows one area per thread, and glibc registers its own unless told not to
+  if (&__rseq_size != NULL && __rseq_size > 0) {
+    struct rseq* rseq = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    return (int32_t)rseq->cpu_id >= 0 ? rseq : NULL;
+  }
+  if ((int32_t)own_rseq.cpu_id >= 0 ||
+      syscall(SYS_rseq, &own_rseq, sizeof(own_rseq), 0, RSEQ_SIG) == 0) {
+    return &own_rseq;
+  }
+#endif
+  return NULL;
+}
+
+
+/**
+  * \brief Make sure the calling thread's cache is flushed when the thread exits, put the thread
+  *        on the per-CPU caches if they are on or else give it a remote free list, and add its
+  *        cache to those whose counters are summed for statistics
+  * \param cache the calling thread's cache
+  */
+void register_thread_cache(thread_cache_t* cache) {
+  //Mark first: pthread_setspecific may itself allocate
+  cache->registered = true;
+  pthread_once(&cpu_caches_once, create_cpu_caches);
+  cache->rseq = cpu_caches != NULL ? thread_rseq() : NULL;
+  //A thread on the per-CPU caches keeps no objects of its own, so it owns no pages
+  cache->owner = cache->rseq == NULL ? acquire_remote_list() : 0;
+
+  pthread_mutex_lock(&stats_lock);
+  cache->prev = NULL;
+  cache->next = thread_caches;
+  if (thread_caches != NULL) thread_caches->prev = cache;
+  thread_caches = cache;
+  pthread_mutex_unlock(&stats_lock);
+
+  pthread_once(&thread_cache_key_once, create_thread_cache_key);
+  pthread_setspecific(thread_cache_key, cache);
+}
+
+
+/**
+  * \brief Take a chain of objects from the central pool under one hold of its lock, allocating
+  *        new pages as the pool runs dry. The calling thread becomes the owner of every page it
+  *        takes from that has no running owner.
+  * \param cache the calling thread's cache, which must be registered
+  * \param index the size class
+  * \param wanted the number of objects to take, at least one
+  * \return free_object_t* the first object of a NULL-terminated chain of wanted objects
+  */
+free_object_t* take_central_objects(thread_cache_t* cache, int index, size_t wanted) {
+  central_list_t* central = &central_lists[index];
+  free_object_t* head = NULL;
+  free_object_t* tail = NULL;
+  size_t taken = 0;
+
+  pthread_mutex_lock(&central->lock);
+
+  while (taken < wanted) {
+    //Put a whole new page into the central pool if it cannot fill a batch
+    page_header_t* page = fullest_page(central);
+    if (page == NULL) {
+      page = allocate_class_page(index);
+      page_list_push(&central->empty, page);
+      central->empty_pages++;
+    }
+    page_header_t** list = page_list_of(central, page);
+    if (page->live == 0) central->empty_pages--;
+    uint16_t owner = page->owner;
+    if (owner == 0 || !__atomic_load_n(&remote_lists[owner].active, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&page->owner, cache->owner, __ATOMIC_RELAXED);
+    }
+
+    //Move objects in page order so consecutive allocations stay on the same page. Freed objects
+    //go first, since their memory is already in use; then slots are carved from the bump offset.
+    size_t size = class_sizes[index];
+    while (taken < wanted && page_has_free(page)) {
+      free_object_t* obj = page->freelist;
+      if (obj != NULL) {
+        page->freelist = obj->next;
+      } else {
+        obj = (free_object_t*)(page_address(page) + page->bump);
+        page->bump += size;
+      }
+      if (tail == NULL) {
+        head = obj;
+      } else {
+        tail->next = obj;
+      }
+      tail = obj;
+      page->live++;
+      taken++;
+    }
+
+    //A full page leaves the lists until one of its objects is returned
+    page_list_update(central, page, list);
+  }
+
+  pthread_mutex_unlock(&central->lock);
+
+  tail->next = NULL;
+  return head;
+}
+
+
+/**
+  * \brief Move a batch of objects from the central pool into an empty thread cache list,
+  *        allocating a new page when the central pool has run dry
+  * \param cache the calling thread's cache
+  * \param index the size class to refill
+  */
+void refill_thread_cache(thread_cache_t* cache, int index) {
+  if (!cache->registered) {
+    register_thread_cache(cache);
+  }
+  shrink_thread_cache(cache);
+
+  cache->freelists[index] = take_central_objects(cache, index, batch_size(index));
+  cache->counts[index] = batch_size(index);
+}
+
+
+#ifdef CPU_CACHES_SUPPORTED
+/**
+  * \brief Pop an object from the calling CPU's list for a size class. This is a restartable
+  *        sequence: storing the count commits it, and if the thread is interrupted before then,
+  *        the kernel sends it to the abort label, which starts the sequence over.
+  * \param rseq the calling thread's rseq area
+  * \param index the size class
+  * \return free_object_t* the object, or NULL if the list is empty or the CPU has no cache
+  */
+static inline free_object_t* cpu_cache_pop(struct rseq* rseq, int index) {
+  cpu_list_t* list = &cpu_caches[0].lists[index];
+  free_object_t* obj;
+  __asm__ __volatile__(
+      ".pushsection __rseq_cs, \"aw\"\n"
+      ".balign 32\n"
+      "cpu_cache_pop_cs%=:\n"
+      ".long 0, 0\n"
+      ".quad cpu_cache_pop_start%=, cpu_cache_pop_commit%= - cpu_cache_pop_start%=, "
+      "cpu_cache_pop_abort%=\n"
+      ".popsection\n"
+      "cpu_cache_pop_retry%=:\n"
+      "leaq cpu_cache_pop_cs%=(%%rip), %%rax\n"
+      "movq %%rax, %[rseq_cs]\n"
+      "cpu_cache_pop_start%=:\n"
+      "movl %[cpu_id], %%eax\n"
+      "cmpl %[cpus], %%eax\n"
+      "jae cpu_cache_pop_empty%=\n"
+      "imulq %[stride], %%rax\n"
+      "addq %[list], %%rax\n"
+      "movq (%%rax), %%rcx\n"
+      "testq %%rcx, %%rcx\n"
+      "jz cpu_cache_pop_empty%=\n"
+      "subq $1, %%rcx\n"
+      "movq 8(%%rax, %%rcx, 8), %[obj]\n"
+      "movq %%rcx, (%%rax)\n"
+      "cpu_cache_pop_commit%=:\n"
+      "jmp cpu_cache_pop_done%=\n"
+      "cpu_cache_pop_empty%=:\n"
+      "xorl %k[obj], %k[obj]\n"
+      "jmp cpu_cache_pop_done%=\n"
+      //The kernel checks for this signature just before the abort label
+      ".long " EXPAND_TO_STRING(RSEQ_SIG) "\n"
+      "cpu_cache_pop_abort%=:\n"
+      "jmp cpu_cache_pop_retry%=\n"
+      "cpu_cache_pop_done%=:\n"
+      : [obj] "=&r"(obj), [rseq_cs] "+m"(rseq->rseq_cs)
+      : [cpu_id] "m"(rseq->cpu_id), [cpus] "n"(MAX_CPUS), [stride] "n"(sizeof(cpu_cache_t)),
+        [list] "r"(list)
+      : "rax", "rcx", "memory", "cc");
+  return obj;
+}
+
+
+/**
+  * \brief Push an object onto the calling CPU's list for a size class, in a restartable
+  *        sequence like cpu_cache_pop's. The slot is written before the count, so an interrupted
+  *        push leaves only an unused slot behind.
+  * \param rseq the calling thread's rseq area
+  * \param index the size class
+  * \param obj the object to push
+  * \return bool false if the list already holds two batches or the CPU has no cache
+  */
+static inline bool cpu_cache_push(struct rseq* rseq, int index, free_object_t* obj) {
+  cpu_list_t* list = &cpu_caches[0].lists[index];
+  size_t capacity = 2 * batch_size(index);
+  int pushed;
+  __asm__ __volatile__(
+      ".pushsection __rseq_cs, \"aw\"\n"
+      ".balign 32\n"
+      "cpu_cache_push_cs%=:\n"
+      ".long 0, 0\n"
+      ".quad cpu_cache_push_start%=, cpu_cache_push_commit%= - cpu_cache_push_start%=, "
+      "cpu_cache_push_abort%=\n"
+      ".popsection\n"
+      "cpu_cache_push_retry%=:\n"
+      "leaq cpu_cache_push_cs%=(%%rip), %%rax\n"
+      "movq %%rax, %[rseq_cs]\n"
+      "cpu_cache_push_start%=:\n"
+      "movl %[cpu_id], %%eax\n"
+      "cmpl %[cpus], %%eax\n"
+      "jae cpu_cache_push_full%=\n"
+      "imulq %[stride], %%rax\n"
+      "addq %[list], %%rax\n"
+      "movq (%%rax), %%rcx\n"
+      "cmpq %[capacity], %%rcx\n"
+      "jae cpu_cache_push_full%=\n"
+      "movq %[obj], 8(%%rax, %%rcx, 8)\n"
+      "addq $1, %%rcx\n"
+      "movq %%rcx, (%%rax)\n"
+      "cpu_cache_push_commit%=:\n"
+      "movl $1, %[pushed]\n"
+      "jmp cpu_cache_push_done%=\n"
+      "cpu_cache_push_full%=:\n"
+      "xorl %[pushed], %[pushed]\n"
+      "jmp cpu_cache_push_done%=\n"
+      ".long " EXPAND_TO_STRING(RSEQ_SIG) "\n"
+      "cpu_cache_push_abort%=:\n"
+      "jmp cpu_cache_push_retry%=\n"
+      "cpu_cache_push_done%=:\n"
+      : [pushed] "=&r"(pushed), [rseq_cs] "+m"(rseq->rseq_cs)
+      : [cpu_id] "m"(rseq->cpu_id), [cpus] "n"(MAX_CPUS), [stride] "n"(sizeof(cpu_cache_t)),
+        [list] "r"(list), [capacity] "r"(capacity), [obj] "r"(obj)
+      : "rax", "rcx", "memory", "cc");
+  return pushed != 0;
+}
+#else
+static inline free_object_t* cpu_cache_pop(struct rseq* rseq, int index) {
+  return NULL;
+}
+
+static inline bool cpu_cache_push(struct rseq* rseq, int index, free_object_t* obj) {
+  return false;
+}
+#endif
+
+
+/**
+  * \brief Pop up to a number of objects from the calling CPU's list for a size class
+  * \param rseq the calling thread's rseq area
+  * \param index the size class
+  * \param wanted the most objects to take
+  * \param head the chain to add the objects to
+  * \return free_object_t* the first object of the longer chain
+  */
+free_object_t* cpu_cache_take(struct rseq* rseq, int index, size_t wanted, free_object_t* head) {
+  for (size_t i = 0; i < wanted; i++) {
+    free_object_t* obj = cpu_cache_pop(rseq, index);
+    if (obj == NULL) break;
+    obj->next = head;
+    head = obj;
+  }
+  return head;
+}
+
+
+/**
+  * \brief Allocate a small object for a thread on the per-CPU caches, refilling the CPU's list
+  *        with a batch from the central pool when it is empty
+  * \param cache the calling thread's cache, which must be registered
+  * \param index the size class
+  * \return void* the object
+  */
+void* cpu_cache_allocate(thread_cache_t* cache, int index) {
+  free_object_t* obj = cpu_cache_pop(cache->rseq, index);
+  if (obj != NULL) return obj;
+
+  //Keep the first object of the batch and push the rest last to first, so they are popped in
+  //page order. The thread may have moved to a CPU whose list is already full, and what does not
+  //fit goes straight back.
+  obj = take_central_objects(cache, index, batch_size(index));
+  free_object_t* rest = NULL;
+  for (free_object_t* next = obj->next; next != NULL;) {
+    free_object_t* reversed = next;
+    next = next->next;
+    reversed->next = rest;
+    rest = reversed;
+  }
+  free_object_t* leftover = NULL;
+  while (rest != NULL) {
+    free_object_t* next = rest->next;
+    if (!cpu_cache_push(cache->rseq, index, rest)) {
+      rest->next = leftover;
+      leftover = rest;
+    }
+    rest = next;
+  }
+  if (leftover != NULL) return_objects(index, leftover);
+  return obj;
+}
+
+
+/**
+  * \brief Free a small object for a thread on the per-CPU caches. When the CPU's list is full,
+  *        a batch of it goes back to the central pool along with the object.
+  * \param cache the calling thread's cache
+  * \param index the size class
+  * \param obj the object being freed
+  */
+void cpu_cache_free(thread_cache_t* cache, int index, free_object_t* obj) {
+  if (cpu_cache_push(cache->rseq, index, obj)) return;
+
+  obj->next = NULL;
+  return_objects(index, cpu_cache_take(cache->rseq, index, batch_size(index), obj));
+}
+
+
+/**
+  * \brief Return every object in the calling CPU's cache to the central pools. The caches of
+  *        other CPUs can only be changed by threads running on them, so they are left alone.
+  * \param cache the calling thread's cache
+  */
+void flush_cpu_cache(thread_cache_t* cache) {
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    free_object_t* head = cpu_cache_take(cache->rseq, index, CPU_CACHE_SLOTS, NULL);
+    if (head != NULL) return_objects(index, head);
+  }
+}
+
+
+/**
+  * \brief Put a small object in the calling thread's cache, handing a batch on when the cache
+  *        list grows too long
+  * \param ptr the object being freed
+  * \param index the object's size class
+  */
+void free_small_object(void* ptr, int index) {
+  //get the block
+  free_object_t* obj = (free_object_t*)ptr;
+  //put it back to this thread's freelist
+  thread_cache_t* cache = &thread_cache;
+  //A thread that only frees still needs its cache flushed, and counted, when it exits
+  if (!cache->registered) {
+    //An exiting thread whose cache is gone gives objects straight back to their pages
+    if (cache->torn_down) {
+      obj->next = NULL;
+      return_objects(index, obj);
+      count_exited_objects(index, 0, 1);
+      return;
+    }
+    register_thread_cache(cache);
+  }
+  STAT_BUMP(cache->frees[index]);
+  if (cache->rseq != NULL) {
+    cpu_cache_free(cache, index, obj);
+    return;
+  }
+  obj->next = cache->freelists[index];
+  cache->freelists[index] = obj;
+  cache->counts[index]++;
+
+  //Hand a batch back once the thread holds more than two batches: to the threads that own its
+  //pages, or else to the central pool
+  if (cache->counts[index] > 2 * batch_size(index)) {
+    flush_thread_cache_batch(cache, index, batch_size(index));
+    shrink_thread_cache(cache);
+  }
+}
+
+
+/**
+  * \brief Find the slot where a large object's address would live in the large object table
+  * \param address the page-aligned start of the object
+  * \return size_t the index of the first slot to probe
+  */
+size_t large_table_slot(uintptr_t address) {
+  //Fibonacci hashing of the page number spreads neighbouring mappings across the table
+  return (size_t)(((address / PAGE_SIZE) * 11400714819323198485ull) >> 32) &
+         (large_table_capacity - 1);
+}
+
+
+/**
+  * \brief Take a snapshot of the allocator's counters, summing the counters of every thread
+  * \param stats the snapshot to fill in
+  * \param wait whether to wait for stats_lock; a signal handler must not, since the thread it
+  *        interrupted may hold it, and then the thread counters are left out
+  */
+void collect_stats(heap_stats_t* stats, bool wait) {
+  memset(stats, 0, sizeof(heap_stats_t));
+
+  //Small objects: allocations and frees are counted by each thread, pages by the central lists
+  if (wait ? pthread_mutex_lock(&stats_lock) == 0 : pthread_mutex_trylock(&stats_lock) == 0) {
+    for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+      stats->allocations[index] = exited_allocations[index];
+      stats->frees[index] = exited_frees[index];
+    }
+    for (thread_cache_t* cache = thread_caches; cache != NULL; cache = cache->next) {
+      for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+        stats->allocations[index] += STAT_READ(cache->allocations[index]);
+        stats->frees[index] += STAT_READ(cache->frees[index]);
+      }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    stats->complete = true;
+  }
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    stats->object_sizes[index] = class_sizes[index];
+    stats->pages[index] =
+        STAT_READ(central_lists[index].pages_mapped) - STAT_READ(central_lists[index].pages_released);
+  }
+
+  //Medium objects each hold a whole span of their class's length
+  for (int index = 0; index < NUM_MEDIUM_CLASSES; index++) {
+    int row = NUM_SIZE_CLASSES + index;
+    stats->object_sizes[row] = medium_class_pages[index] * PAGE_SIZE;
+    stats->allocations[row] = STAT_READ(medium_allocations[index]);
+    stats->frees[row] = STAT_READ(medium_frees[index]);
+    stats->pages[row] = (stats->allocations[row] - stats->frees[row]) * medium_class_pages[index];
+  }
+
+  //Large objects have no class; their row has no object size
+  int row = NUM_STATS_CLASSES - 1;
+  stats->allocations[row] = STAT_READ(large_allocations);
+  stats->frees[row] = STAT_READ(large_frees);
+  stats->pages[row] = STAT_READ(large_live_bytes) / PAGE_SIZE;
+}
+
+
+/**
+  * \brief Append text to a line of the statistics report, right-aligned in a column
+  * \param line the line being built
+  * \param length the length of the line so far, advanced past the text
+  * \param text the text to append
+  * \param width the width of the column
+  */
+void append_text(char* line, size_t* length, char* text, int width) {
+  int text_length = 0;
+  while (text[text_length] != '\0') {
+    text_length++;
+  }
+  for (int i = text_length; i < width; i++) {
+    line[(*length)++] = ' ';
+  }
+  for (int i = 0; i < text_length; i++) {
+    line[(*length)++] = text[i];
+  }
+  line[*length] = '\0';
+}
+
+
+/**
+  * \brief Append a number to a line of the statistics report, right-aligned in a column.
+  *        This formats the number itself, since printf is not safe in a signal handler.
+  * \param line the line being built
+  * \param length the length of the line so far, advanced past the number
+  * \param value the number to append
+  * \param width the width of the column
+  */
+void append_number(char* line, size_t* length, size_t value, int width) {
+  char digits[24];
+  int count = sizeof(digits) - 1;
+  digits[count] = '\0';
+  do {
+    digits[--count] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  append_text(line, length, &digits[count], width);
+}
+
+
+/**
+  * \brief Write every counter to standard error with log_message, one row per size class that
+  *        has been used, followed by totals and the allocator's system calls
+  * \param wait whether the thread counters may wait for stats_lock, see collect_stats
+  */
+void report_stats(bool wait) {
+  heap_stats_t stats;
+  collect_stats(&stats, wait);
+
+  char line[160];
+  size_t length = 0;
+  log_message("------------------------- allocator statistics -------------------------\n");
+  append_text(line, &length, "size", 10);
+  append_text(line, &length, "allocs", 12);
+  append_text(line, &length, "frees", 12);
+  append_text(line, &length, "live", 12);
+  append_text(line, &length, "live KiB", 12);
+  append_text(line, &length, "pages", 10);
+  append_text(line, &length, "\n", 1);
+  log_message(line);
+
+  size_t total_allocations = 0;
+  size_t total_frees = 0;
+  size_t total_pages = 0;
+  for (int row = 0; row < NUM_STATS_CLASSES; row++) {
+    if (stats.allocations[row] == 0 && stats.frees[row] == 0) continue;
+
+    //Frees can outrun allocations while another thread's counts are being read
+    size_t live = stats.allocations[row] > stats.frees[row] ? stats.allocations[row] - stats.frees[row] : 0;
+    size_t live_bytes = row == NUM_STATS_CLASSES - 1 ? stats.pages[row] * PAGE_SIZE
+                                                     : live * stats.object_sizes[row];
+    length = 0;
+    if (row == NUM_STATS_CLASSES - 1) {
+      append_text(line, &length, "large", 10);
+    } else {
+      append_number(line, &length, stats.object_sizes[row], 10);
+    }
+    append_number(line, &length, stats.allocations[row], 12);
+    append_number(line, &length, stats.frees[row], 12);
+    append_number(line, &length, live, 12);
+    append_number(line, &length, live_bytes / 1024, 12);
+    append_number(line, &length, stats.pages[row], 10);
+    append_text(line, &length, "\n", 1);
+    log_message(line);
+
+    total_allocations += stats.allocations[row];
+    total_frees += stats.frees[row];
+    total_pages += stats.pages[row];
+  }
+
+  length = 0;
+  append_text(line, &length, "total", 10);
+  append_number(line, &length, total_allocations, 12);
+  append_number(line, &length, total_frees, 12);
+  append_number(line, &length, total_allocations > total_frees ? total_allocations - total_frees : 0, 12);
+  append_text(line, &length, "", 12);
+  append_number(line, &length, total_pages, 10);
+  append_text(line, &length, "\n", 1);
+  log_message(line);
+
+  length = 0;
+  append_text(line, &length, "mmap calls ", 0);
+  append_number(line, &length, STAT_READ(mmap_calls), 0);
+  append_text(line, &length, ", munmap calls ", 0);
+  append_number(line, &length, STAT_READ(munmap_calls), 0);
+  append_text(line, &length, ", mprotect calls ", 0);
+  append_number(line, &length, STAT_READ(mprotect_calls), 0);
+  append_text(line, &length, ", mremap calls ", 0);
+  append_number(line, &length, STAT_READ(mremap_calls), 0);
+  append_text(line, &length, ", madvise calls ", 0);
+  append_number(line, &length, STAT_READ(madvise_calls), 0);
+  append_text(line, &length, "\n", 0);
+  log_message(line);
+
+  length = 0;
+  append_text(line, &length, "KiB mapped ", 0);
+  append_number(line, &length, STAT_READ(mapped_bytes) / 1024, 0);
+  append_text(line, &length, ", KiB returned to the kernel ", 0);
+  append_number(line, &length, STAT_READ(released_bytes) / 1024, 0);
+  append_text(line, &length, "\n", 0);
+  log_message(line);
+
+  if (huge_pages) {
+    length = 0;
+    append_text(line, &length, "huge pages in use ", 0);
+    append_number(line, &length, STAT_READ(huge_pages_in_use), 0);
+    append_text(line, &length, " of ", 0);
+    append_number(line, &length, STAT_READ(heap_mapped) / HUGE_PAGE_SIZE, 0);
+    append_text(line, &length, " mapped\n", 0);
+    log_message(line);
+  }
+
+  if (scavenger_on) {
+    length = 0;
+    append_text(line, &length, "scavenger passes ", 0);
+    append_number(line, &length, STAT_READ(scavenger_passes), 0);
+    append_text(line, &length, ", next in ", 0);
+    append_number(line, &length, STAT_READ(scavenger_interval_ms), 0);
+    append_text(line, &length, " ms\n", 0);
+    log_message(line);
+  }
+
+  if (!stats.complete) {
+    log_message("(thread counters were busy; small object counts are missing)\n");
+  }
+}
+
+
+/**
+  * \brief SIGUSR2 handler that dumps the statistics
+  * \param signal the signal number
+  */
+void report_stats_on_signal(int signal) {
+  int saved_errno = errno;
+  report_stats(false);
+  errno = saved_errno;
+}
+
+
+/**
+  * \brief Dump the statistics when the program exits, if STATS_ENV_VAR asked for it
+  */
+__attribute__((destructor)) void report_stats_at_exit(void) {
+  if (stats_at_exit) report_stats(true);
+}
+
+
+/**
+  * \brief Read STATS_ENV_VAR when the library is loaded, and install the SIGUSR2 handler if it
+  *        asks for dumps on signal
+  */
+__attribute__((constructor)) void install_stats_reporting(void) {
+  char* when = getenv(STATS_ENV_VAR);
+  if (when == NULL) return;
+
+  stats_at_exit = strstr(when, "exit") != NULL;
+  if (strstr(when, "signal") != NULL) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = report_stats_on_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+  }
+}
+
+
+/**
+  * \brief Grow the large object table to twice its capacity (or create it), rehashing entries
+  * \return bool false if the new table could not be mapped
+  */
+bool large_table_grow(void) {
+  size_t old_capacity = large_table_capacity;
+  large_entry_t* old_table = large_table;
+  size_t capacity = old_capacity == 0 ? LARGE_TABLE_MIN_CAPACITY : old_capacity * 2;
+
+  void* block = map_memory(capacity * sizeof(large_entry_t));
+  if (block == MAP_FAILED) return false;
+
+  large_table = (large_entry_t*)block;
+  large_table_capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_table[i].address == 0) continue;
+    size_t slot = large_table_slot(old_table[i].address);
+    while (large_table[slot].address != 0) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    large_table[slot] = old_table[i];
+  }
+
+  if (old_table != NULL) {
+    unmap_memory(old_table, old_capacity * sizeof(large_entry_t));
+  }
+  return true;
+}
+
+
+/**
+  * \brief Record a large object in the large object table. Caller holds large_lock.
+  * \param address the start of the mapping
+  * \param size the number of bytes mapped
+  * \return bool false if the table could not grow to hold the entry
+  */
+bool large_table_insert(uintptr_t address, size_t size) {
+  //Keep the load factor at or below one half so probe sequences stay short
+  if ((large_table_count + 1) * 2 > large_table_capacity && !large_table_grow()) {
+    return false;
+  }
+
+  size_t slot = large_table_slot(address);
+  while (large_table[slot].address != 0) {
+    slot = (slot + 1) & (large_table_capacity - 1);
+  }
+  large_table[slot].address = address;
+  large_table[slot].size = size;
+  large_table_count++;
+  return true;
+}
+
+
+/**
+  * \brief Find a large object's slot in the large object table. Caller holds large_lock.
+  * \param address the start of the object
+  * \return large_entry_t* the table entry, or NULL if the address is not a large object
+  */
+large_entry_t* large_table_find(uintptr_t address) {
+  if (large_table_capacity == 0) return NULL;
+
+  size_t slot = large_table_slot(address);
+  while (large_table[slot].address != 0) {
+    if (large_table[slot].address == address) return &large_table[slot];
+    slot = (slot + 1) & (large_table_capacity - 1);
+  }
+  return NULL;
+}
+
+
+/**
+  * \brief Remove an entry from the large object table. Caller holds large_lock.
+  *        Later entries in the probe run are shifted back so lookups never need tombstones.
+  * \param entry the entry returned by large_table_find
+  */
+void large_table_remove(large_entry_t* entry) {
+  size_t mask = large_table_capacity - 1;
+  size_t hole = entry - large_table;
+  size_t slot = (hole + 1) & mask;
+
+  while (large_table[slot].address != 0) {
+    //An entry may fill the hole only if the hole lies between its home slot and its slot
+    size_t home = large_table_slot(large_table[slot].address);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      large_table[hole] = large_table[slot];
+      hole = slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  large_table[hole].address = 0;
+  large_table_count--;
+}
+
+
+/**
+  * \brief Take a cached mapping of exactly the requested size. Caller holds large_lock.
+  * \param size the page-rounded size wanted
+  * \param alignment the alignment the mapping must start at, a power of two
+  * \return void* the mapping, or NULL if none of that size and alignment is cached
+  */
+void* large_cache_take(size_t size, size_t alignment) {
+  //Search newest first; the most recently freed mapping is the most likely to be resident
+  for (size_t i = large_cache_count; i > 0; i--) {
+    if (large_cache[i - 1].size != size || large_cache[i - 1].address % alignment != 0) continue;
+
+    void* block = (void*)large_cache[i - 1].address;
+    for (size_t j = i; j < large_cache_count; j++) {
+      large_cache[j - 1] = large_cache[j];
+    }
+    large_cache_count--;
+    if (i <= large_cache_aged) large_cache_aged--;
+    large_cache_bytes -= size;
+    return block;
+  }
+  return NULL;
+}
+
+
+/**
+  * \brief Keep a freed large mapping for reuse, evicting the oldest cached mappings to stay
+  *        within the cache bounds. Caller holds large_lock.
+  * \param address the start of the freed mapping
+  * \param size the number of bytes mapped
+  * \return bool false if the mapping is too big to cache and should be unmapped
+  */
+bool large_cache_put(uintptr_t address, size_t size) {
+  if (size > LARGE_CACHE_MAX_BYTES / 4) return false;
+
+  while (large_cache_count == LARGE_CACHE_ENTRIES || large_cache_bytes + size > LARGE_CACHE_MAX_BYTES) {
+    unmap_memory((void*)large_cache[0].address, large_cache[0].size);
+    large_cache_bytes -= large_cache[0].size;
+    large_cache_count--;
+    if (large_cache_aged > 0) large_cache_aged--;
+    for (size_t j = 0; j < large_cache_count; j++) {
+      large_cache[j] = large_cache[j + 1];
+    }
+  }
+
+  large_cache[large_cache_count].address = address;
+  large_cache[large_cache_count].size = size;
+  large_cache_count++;
+  large_cache_bytes += size;
+  return true;
+}
+
+
+/**
+  * \brief Map memory for a large object at a given alignment. Alignments beyond a page are met by
+  *        over-mapping and unmapping the slack on both sides.
+  * \param size the page-rounded size of the object
+  * \param alignment the alignment of the mapping, a power of two of at least PAGE_SIZE
+  * \return void* the mapping, or NULL if it could not be mapped
+  */
+void* map_aligned(size_t size, size_t alignment) {
+  size_t slack = alignment - PAGE_SIZE;
+  if (size + slack < size) return NULL;
+
+  char* block = map_memory(size + slack);
+  if (block == MAP_FAILED) return NULL;
+
+  char* start = (char*)ROUND_UP((uintptr_t)block, alignment);
+  if (start != block) unmap_memory(block, start - block);
+  if (start + size != block + size + slack) unmap_memory(start + size, block + slack - start);
+  return start;
+}
+
+
+/**
+  * \brief Allocate a large object, reusing a cached mapping of the same page count if possible
+  * \param size the page-rounded size of the object
+  * \param alignment the alignment of the object, a power of two of at least PAGE_SIZE
+  * \param zeroed if not NULL, set to whether the object is known to read as zeroes
+  * \return void* the start of the object, or NULL if no memory could be mapped
+  */
+void* allocate_large(size_t size, size_t alignment, bool* zeroed) {
+  pthread_mutex_lock(&large_lock);
+  void* block = large_cache_take(size, alignment);
+  pthread_mutex_unlock(&large_lock);
+
+  //Only a cached mapping can hold old data; a fresh one comes zero-filled from the kernel
+  if (zeroed != NULL) *zeroed = block == NULL;
+  if (block == NULL) {
+    block = map_aligned(size, alignment);
+    if (block == NULL) return NULL;
+  }
+
+  pthread_mutex_lock(&large_lock);
+  bool recorded = large_table_insert((uintptr_t)block, size);
+  if (recorded) {
+    large_allocations++;
+    large_live_bytes += size;
+  }
+  pthread_mutex_unlock(&large_lock);
+
+  if (!recorded) {
+    unmap_memory(block, size);
+    return NULL;
+  }
+  return block;
+}
+
+
+/**
+  * \brief Free a large object, caching its mapping for reuse or returning it to the OS
+  * \param ptr the page-aligned start of the object
+  */
+void free_large(void* ptr) {
+  pthread_mutex_lock(&large_lock);
+  large_entry_t* entry = large_table_find((uintptr_t)ptr);
+  //Not one of ours; ignore it like any other foreign pointer
+  if (entry == NULL) {
+    pthread_mutex_unlock(&large_lock);
+    return;
+  }
+
+  size_t size = entry->size;
+  large_table_remove(entry);
+  large_frees++;
+  large_live_bytes -= size;
+  bool cached = large_cache_put((uintptr_t)ptr, size);
+  pthread_mutex_unlock(&large_lock);
+
+  if (!cached) {
+    unmap_memory(ptr, size);
+  }
+}
+
+/**
+  * \brief Resize a large object with mremap, so the kernel moves page table entries rather than
+  *        the object's contents
+  * \param ptr the start of the object
+  * \param size the new size, more than MAX_MEDIUM_SIZE
+  * \return void* the object's new location, or NULL if it could not be resized
+  */
+void* resize_large(void* ptr, size_t size) {
+  size = round_up_to_multiple_of_page_size(size);
+  if (size == 0) return NULL;
+
+  pthread_mutex_lock(&large_lock);
+  large_entry_t* entry = large_table_find((uintptr_t)ptr);
+  size_t old_size = entry == NULL ? 0 : entry->size;
+  pthread_mutex_unlock(&large_lock);
+
+  if (old_size == 0) return NULL;
+  if (old_size == size) return ptr;
+
+  void* moved = mremap(ptr, old_size, size, MREMAP_MAYMOVE);
+  STAT_ADD(mremap_calls, 1);
+  if (moved == MAP_FAILED) return NULL;
+  STAT_ADD(mapped_bytes, size - old_size);
+
+  //Replacing the entry keeps the table's count unchanged, so the insert never has to grow it
+  pthread_mutex_lock(&large_lock);
+  large_table_remove(large_table_find((uintptr_t)ptr));
+  large_table_insert((uintptr_t)moved, size);
+  large_live_bytes += size - old_size;
+  pthread_mutex_unlock(&large_lock);
+  return moved;
+}
+
+
+/**
+  * \brief Return half of every per-CPU cache list, rounded up. A CPU's lists may only be changed
+  *        by a thread running on it, so the scavenger moves itself to each CPU in turn.
+  */
+void shrink_cpu_caches(void) {
+#ifdef CPU_CACHES_SUPPORTED
+  struct rseq* rseq = thread_rseq();
+  cpu_set_t allowed;
+  if (rseq == NULL || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+
+  for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    cpu_set_t only;
+    CPU_ZERO(&only);
+    CPU_SET(cpu, &only);
+    if (sched_setaffinity(0, sizeof(only), &only) != 0) continue;
+
+    for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+      size_t count = __atomic_load_n(&cpu_caches[cpu].lists[index].count, __ATOMIC_RELAXED);
+      if (count == 0) continue;
+      free_object_t* head = cpu_cache_take(rseq, index, (count + 1) / 2, NULL);
+      if (head != NULL) return_objects(index, head);
+    }
+  }
+  sched_setaffinity(0, sizeof(allowed), &allowed);
+#endif
+}
+
+
+/**
+  * \brief Make one scavenger pass: signal threads to shrink their caches, shrink the per-CPU
+  *        caches, release half of each size class's empty pages beyond EMPTY_PAGES_KEPT, release
+  *        every free span that still holds memory with MADV_FREE, and unmap cached large
+  *        mappings that nobody reused since the last pass
+  * \return bool whether any memory was released
+  */
+bool scavenge(void) {
+  bool released = false;
+
+  STAT_BUMP(scavenger_passes);
+  if (cpu_caches != NULL) shrink_cpu_caches();
+
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    central_list_t* central = &central_lists[index];
+    pthread_mutex_lock(&central->lock);
+    size_t excess = central->empty_pages > EMPTY_PAGES_KEPT ? central->empty_pages - EMPTY_PAGES_KEPT : 0;
+    if (release_empty_pages(central, central->empty_pages - (excess + 1) / 2) != 0) released = true;
+    pthread_mutex_unlock(&central->lock);
+  }
+
+  //Free spans are lazily released whole, empty superblocks included. In huge page mode only the
+  //huge pages a span covers entirely go, so none is split, and the span is only trimmed: its
+  //edges still hold memory until a merge lets them fill a huge page.
+  pthread_mutex_lock(&superblock_lock);
+  for (int bin = 1; bin <= MAX_MEDIUM_PAGES; bin++) {
+    for (span_t* span = free_spans[bin]; span != NULL; span = span->next) {
+      if (span->released || span->trimmed) continue;
+      uintptr_t first = (uintptr_t)span_start(span);
+      uintptr_t last = first + (size_t)span->pages * PAGE_SIZE;
+      uintptr_t start = first;
+      uintptr_t end = last;
+      if (huge_pages) {
+        start = ROUND_UP(start, HUGE_PAGE_SIZE);
+        end -= end % HUGE_PAGE_SIZE;
+      }
+      if (start == first && end == last) {
+        span->released = true;
+      } else {
+        span->trimmed = true;
+      }
+      if (start >= end) continue;
+      release_memory_lazily((void*)start, end - start);
+      released = true;
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+
+  pthread_mutex_lock(&large_lock);
+  for (size_t i = 0; i < large_cache_aged; i++) {
+    unmap_memory((void*)large_cache[i].address, large_cache[i].size);
+    large_cache_bytes -= large_cache[i].size;
+    released = true;
+  }
+  for (size_t j = large_cache_aged; j < large_cache_count; j++) {
+    large_cache[j - large_cache_aged] = large_cache[j];
+  }
+  large_cache_count -= large_cache_aged;
+  large_cache_aged = large_cache_count;
+  pthread_mutex_unlock(&large_lock);
+
+  return released;
+}
+
+
+/**
+  * \brief Count the pages, medium spans and large mappings handed out so far, as a measure of
+  *        how hard the program is working the heap
+  * \return size_t the total
+  */
+size_t heap_activity(void) {
+  size_t total = STAT_READ(large_allocations);
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    total += STAT_READ(central_lists[index].pages_mapped);
+  }
+  for (int index = 0; index < NUM_MEDIUM_CLASSES; index++) {
+    total += STAT_READ(medium_allocations[index]);
+  }
+  return total;
+}
+
+
+/**
+  * \brief The scavenger thread's body. It sleeps longer after a pass that found nothing to
+  *        release, or while the heap is busy, and shorter while there is memory to give back
+  *        and the program is quiet.
+  * \param arg unused
+  * \return void* never returns
+  */
+void* run_scavenger(void* arg) {
+  //Leave the program's signals to its own threads
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  size_t interval = SCAVENGER_START_INTERVAL_MS;
+  size_t last_activity = heap_activity();
+  for (;;) {
+    struct timespec sleep = {interval / 1000, (interval % 1000) * 1000000};
+    nanosleep(&sleep, NULL);
+
+    size_t activity = heap_activity();
+    bool busy = (activity - last_activity) * 1000 / interval > SCAVENGER_BUSY_RATE;
+    last_activity = activity;
+
+    if (scavenge() && !busy) {
+      interval = interval / 2 < SCAVENGER_MIN_INTERVAL_MS ? SCAVENGER_MIN_INTERVAL_MS : interval / 2;
+    } else {
+      interval = interval * 2 > SCAVENGER_MAX_INTERVAL_MS ? SCAVENGER_MAX_INTERVAL_MS : interval * 2;
+    }
+    __atomic_store_n(&scavenger_interval_ms, interval, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+
+/**
+  * \brief Start the scavenger when the library is loaded, if SCAVENGE_ENV_VAR asks for it
+  */
+__attribute__((constructor)) void start_scavenger(void) {
+  char* mode = getenv(SCAVENGE_ENV_VAR);
+  if (mode == NULL || strcmp(mode, "1") != 0) return;
+
+  //Let empty pages wait for the scavenger; this must be set before the thread can run
+  empty_pages_limit = SCAVENGER_EMPTY_PAGES_KEPT;
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  if (pthread_create(&thread, &attributes, run_scavenger, NULL) == 0) {
+    scavenger_on = true;
+  } else {
+    empty_pages_limit = EMPTY_PAGES_KEPT;
+  }
+  pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Allocate space on the heap.
+ * \param size  The minimium number of bytes that must be allocated
+ * \returns     A pointer to the beginning of the allocated space.
+ *              This function may return NULL when an error occurs.
+ */
+void* xxmalloc(size_t size) {
+  //Case 1: The size is larger than 2048
+  if (size > MAX_SMALL_SIZE) {
+    //Medium objects get a span of pages from a superblock
+    if (size <= MAX_MEDIUM_SIZE) return allocate_medium(size, NULL);
+
+    //Give the object its own page-rounded mapping, recorded so it can be freed later
+    return allocate_large(round_up_to_multiple_of_page_size(size), PAGE_SIZE, NULL);
+  }
+
+  //Finding the corresponding index of freelist corresponding of the size
+  int index = size_to_index(size);
+
+  //Case 2: The rounded-up size is smaller than or equal to 2048
+  //Take an object from this thread's cache, refilling it from the central pool when empty
+  thread_cache_t* cache = &thread_cache;
+  if (cache->freelists[index] == NULL) {
+    if (!cache->registered) {
+      //An exiting thread whose cache is gone takes objects straight from the central pool
+      if (cache->torn_down) {
+        count_exited_objects(index, 1, 0);
+        return take_central_objects(cache, index, 1);
+      }
+      register_thread_cache(cache);
+    }
+    //Threads on the per-CPU caches keep no lists of their own, so they always come here
+    if (cache->rseq != NULL) {
+      STAT_BUMP(cache->allocations[index]);
+      return cpu_cache_allocate(cache, index);
+    }
+    //Objects other threads sent back come first, since taking them needs no lock
+    if (cache->owner != 0) drain_remote_frees(cache, &remote_lists[cache->owner]);
+    if (cache->freelists[index] == NULL) refill_thread_cache(cache, index);
+  }
+
+  //Get the first element of the corresponding freelist
+  free_object_t* obj = cache->freelists[index];
+  cache->freelists[index] = obj->next; //delete it from the freelist
+  cache->counts[index]--;
+  STAT_BUMP(cache->allocations[index]);
+  return (void*)obj;
+}
+
+/**
+ * Allocate space on the heap at a given alignment.
+ * \param alignment The alignment of the object, a power of two
+ * \param size      The minimium number of bytes that must be allocated
+ * \returns         A pointer to the beginning of the allocated space, which is a multiple of
+ *                  alignment. This function may return NULL when an error occurs.
+ */
+void* xxmemalign(size_t alignment, size_t size) {
+  //Every object is at least this aligned
+  if (alignment <= MIN_MALLOC_SIZE) return xxmalloc(size);
+
+  if (size <= MAX_SMALL_SIZE && alignment <= MAX_SMALL_SIZE) {
+    return xxmalloc(class_sizes[aligned_size_to_index(size, alignment)]);
+  }
+
+  //A request for nothing still gets an object of its own, like malloc(0)
+  if (size == 0) size = 1;
+
+  //Medium objects take whole spans, so they start on a page boundary. That also serves small
+  //objects aligned beyond the small classes, at the cost of a page.
+  if (size <= MAX_MEDIUM_SIZE && alignment <= PAGE_SIZE) {
+    return allocate_medium(size, NULL);
+  }
+
+  //Anything else gets its own mapping, aligned to at least a page. Rounding up wraps to 0 only
+  //when the size is too big to map.
+  size = round_up_to_multiple_of_page_size(size);
+  if (size == 0) return NULL;
+  return allocate_large(size, alignment > PAGE_SIZE ? alignment : PAGE_SIZE, NULL);
+}
+
+/**
+ * Allocate zero-filled space on the heap. Memory straight from the kernel is already zeroed, so
+ * only objects that reuse freed memory are cleared.
+ * \param count The number of elements
+ * \param size  The size of each element
+ * \returns     A pointer to the beginning of the zeroed space, or NULL if count * size overflows
+ *              or an error occurs.
+ */
+void* xxcalloc(size_t count, size_t size) {
+  size_t bytes;
+  if (__builtin_mul_overflow(count, size, &bytes)) return NULL;
+
+  bool zeroed = false;
+  void* ptr;
+  if (bytes > MAX_MEDIUM_SIZE) {
+    ptr = allocate_large(round_up_to_multiple_of_page_size(bytes), PAGE_SIZE, &zeroed);
+  } else if (bytes > MAX_SMALL_SIZE) {
+    ptr = allocate_medium(bytes, &zeroed);
+  } else {
+    //Small objects are always cleared. Even a slot carved from a fresh page had its first word
+    //written as a free list link on the way into the thread cache, and nothing there records
+    //which cached objects were never used. Carving already faulted the page in, so clearing a
+    //small object costs a short memset and no memory.
+    ptr = xxmalloc(bytes);
+  }
+
+  if (ptr != NULL && !zeroed) memset(ptr, 0, bytes);
+  return ptr;
+}
+
+/**
+ * Free space occupied by a heap object.
+ * \param ptr   A pointer somewhere inside the object that is being freed
+ */
+void xxfree(void* ptr) {
+  //Objects outside the heap range are large objects, which start on a page boundary
+  if (!in_heap(ptr)) {
+    if (ptr != NULL && (uintptr_t)ptr % PAGE_SIZE == 0) free_large(ptr);
+    return;
+  }
+
+  //determine which block-size that this ptr belongs to
+  uint8_t page_class = page_classes[page_number(ptr)];
+
+  //Pages that hold no objects are not ours to free into, and arena objects die with their arena
+  if (page_class == 0 || page_class == PAGE_CLASS_ARENA) return;
+
+  //Medium objects give their whole span back
+  if (page_class == PAGE_CLASS_MEDIUM) {
+    free_medium(page_of(ptr));
+    return;
+  }
+
+  //transit to freelist index
+  free_small_object(ptr, page_class - 1);
+}
+
+/**
+ * Free a heap object whose size the caller already knows, skipping the lookup of its page's size
+ * class for small objects.
+ * \param ptr   The object to free, allocated by xxmalloc, xxcalloc or xxrealloc, or NULL
+ * \param size  The size the object was last allocated or resized with
+ */
+void xxfree_sized(void* ptr, size_t size) {
+  if (ptr == NULL || size > MAX_SMALL_SIZE) {
+    xxfree(ptr);
+    return;
+  }
+  free_small_object(ptr, size_to_index(size));
+}
+
+/**
+ * Free a heap object allocated by xxmemalign whose size and alignment the caller already knows,
+ * skipping the lookup of its page's size class for small objects.
+ * \param ptr       The object to free, or NULL
+ * \param alignment The alignment the object was allocated with
+ * \param size      The size the object was allocated with
+ */
+void xxfree_aligned_sized(void* ptr, size_t alignment, size_t size) {
+  if (ptr == NULL || size > MAX_SMALL_SIZE || alignment > MAX_SMALL_SIZE) {
+    xxfree(ptr);
+    return;
+  }
+  free_small_object(ptr, aligned_size_to_index(size, alignment));
+}
+
+/**
+ * Allocate many objects of one size at once. Small objects are unlinked from the thread cache as
+ * one chain, and whatever it lacks is taken from the central pool, and from new pages, under a
+ * single hold of the size class's lock.
+ * \param size  The minimum number of bytes each object must hold
+ * \param count The number of objects wanted
+ * \param out   An array of at least count pointers that receives the objects
+ * \returns     The number of objects allocated, which is less than count only when an error
+ *              occurs. Those objects are at the front of out.
+ */
+size_t xxmalloc_batch(size_t size, size_t count, void** out) {
+  if (size > MAX_SMALL_SIZE) {
+    for (size_t i = 0; i < count; i++) {
+      out[i] = xxmalloc(size);
+      if (out[i] == NULL) return i;
+    }
+    return count;
+  }
+  if (count == 0) return 0;
+
+  int index = size_to_index(size);
+  thread_cache_t* cache = &thread_cache;
+  //An exiting thread whose cache is gone has empty lists, so everything comes from the central pool
+  if (!cache->registered && !cache->torn_down) {
+    register_thread_cache(cache);
+  }
+  if (cache->counts[index] < count && cache->owner != 0) {
+    drain_remote_frees(cache, &remote_lists[cache->owner]);
+  }
+
+  //Take the front of the thread's list, then anything still missing from the central pool
+  size_t taken = 0;
+  free_object_t* obj = cache->freelists[index];
+  while (taken < count && obj != NULL) {
+    out[taken++] = obj;
+    obj = obj->next;
+  }
+  cache->freelists[index] = obj;
+  cache->counts[index] -= taken;
+
+  if (taken < count) {
+    obj = take_central_objects(cache, index, count - taken);
+    while (obj != NULL) {
+      out[taken++] = obj;
+      obj = obj->next;
+    }
+  }
+
+  if (cache->torn_down) {
+    count_exited_objects(index, count, 0);
+  } else {
+    STAT_BUMP_BY(cache->allocations[index], count);
+  }
+  return count;
+}
+
+/**
+ * Free many heap objects at once. Small objects go onto the thread cache, and lists that grow
+ * too long are cut back once at the end, each returning its excess as one chain.
+ * \param ptrs  The objects to free, any of which may be NULL
+ * \param count The number of pointers in ptrs
+ */
+void xxfree_batch(void** ptrs, size_t count) {
+  thread_cache_t* cache = &thread_cache;
+  if (!cache->registered) {
+    //An exiting thread whose cache is gone frees one object at a time, straight to the pages
+    if (cache->torn_down) {
+      for (size_t i = 0; i < count; i++) {
+        xxfree(ptrs[i]);
+      }
+      return;
+    }
+    register_thread_cache(cache);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    void* ptr = ptrs[i];
+    uint8_t page_class = in_heap(ptr) ? page_classes[page_number(ptr)] : 0;
+    if (page_class == 0 || page_class >= PAGE_CLASS_ARENA) {
+      xxfree(ptr);
+      continue;
+    }
+
+    int index = page_class - 1;
+    free_object_t* obj = (free_object_t*)ptr;
+    obj->next = cache->freelists[index];
+    cache->freelists[index] = obj;
+    cache->counts[index]++;
+    STAT_BUMP(cache->frees[index]);
+  }
+
+  //A thread on the per-CPU caches never allocates from its own lists, so it empties them
+  if (cache->rseq != NULL) {
+    flush_thread_cache(cache);
+  } else {
+    flush_long_thread_cache_lists(cache);
+  }
+}
+
+/**
+ * Create an empty arena. It takes no pages until its first object is allocated.
+ * \returns     The arena, or NULL if an error occurs
+ */
+arena_t* arena_create(void) {
+  arena_t* arena = xxmalloc(sizeof(arena_t));
+  if (arena == NULL) return NULL;
+  memset(arena, 0, sizeof(arena_t));
+  arena->next_pages = ARENA_FIRST_SPAN_PAGES;
+  return arena;
+}
+
+/**
+ * Allocate an object from an arena by bumping a pointer through the arena's newest span. An
+ * object too big for any span becomes a large object that the arena frees on reset.
+ * \param arena The arena
+ * \param size  The minimum number of bytes that must be allocated
+ * \returns     A 16-byte aligned pointer to the object, or NULL if an error occurs
+ */
+void* arena_alloc(arena_t* arena, size_t size) {
+  //Round so the object ends where the next object's size goes
+  size_t usable = ROUND_UP(size + sizeof(size_t), 2 * sizeof(size_t)) - sizeof(size_t);
+  if (usable < size) return NULL;
+
+  if (usable + 2 * sizeof(size_t) > MAX_MEDIUM_SIZE) {
+    size_t rounded = round_up_to_multiple_of_page_size(size);
+    if (rounded == 0) return NULL;
+    arena_large_t* entry = arena_alloc(arena, sizeof(arena_large_t));
+    if (entry == NULL) return NULL;
+    entry->object = allocate_large(rounded, PAGE_SIZE, NULL);
+    if (entry->object == NULL) return NULL;
+    entry->next = arena->large;
+    arena->large = entry;
+    return entry->object;
+  }
+
+  if ((size_t)(arena->end - arena->bump) < usable + sizeof(size_t)) {
+    arena_add_span(arena, usable);
+  }
+  *(size_t*)arena->bump = usable;
+  void* object = arena->bump + sizeof(size_t);
+  arena->bump += sizeof(size_t) + usable;
+  return object;
+}
+
+/**
+ * Free every object allocated from an arena. All of its spans go back to the shared pool, one
+ * call per span, with no work for the objects in them.
+ * \param arena The arena
+ */
+void arena_reset(arena_t* arena) {
+  for (arena_large_t* entry = arena->large; entry != NULL; entry = entry->next) {
+    free_large(entry->object);
+  }
+
+  page_header_t* header = arena->spans;
+  while (header != NULL) {
+    page_header_t* next = header->next;
+    char* start = page_address(header);
+    size_t pages = header->object_size / PAGE_SIZE;
+    memset(page_classes + page_number(start), 0, pages);
+    STAT_SUB(arena_bytes, header->object_size);
+    free_span(start, false);
+    header = next;
+  }
+
+  memset(arena, 0, sizeof(arena_t));
+  arena->next_pages = ARENA_FIRST_SPAN_PAGES;
+}
+
+/**
+ * Free every object allocated from an arena, and the arena itself.
+ * \param arena The arena, or NULL
+ */
+void arena_destroy(arena_t* arena) {
+  if (arena == NULL) return;
+  arena_reset(arena);
+  xxfree(arena);
+}
+
+/**
+ * Change the size of a heap object, in place when possible. Small objects stay put when the new
+ * size is in the same size class, medium objects grow into free pages that follow their span,
+ * and large objects are remapped by the kernel instead of copied.
+ * \param ptr   The object to resize; must not be NULL
+ * \param size  The minimium number of bytes the object must hold afterwards; must not be zero
+ * \returns     A pointer to the resized object, or NULL if it could not be resized, in which
+ *              case the original object is untouched.
+ */
+void* xxrealloc(void* ptr, size_t size) {
+  size_t old_size = xxmalloc_usable_size(ptr);
+
+  if (!in_heap(ptr)) {
+    //A large object staying large
+    if (old_size != 0 && size > MAX_MEDIUM_SIZE) return resize_large(ptr, size);
+  } else if (old_size > MAX_SMALL_SIZE) {
+    //A medium object staying medium
+    if (size > MAX_SMALL_SIZE && size <= MAX_MEDIUM_SIZE && resize_medium(page_of(ptr), size)) {
+      return ptr;
+    }
+  } else if (old_size != 0) {
+    //A small object staying in its size class
+    if (size <= MAX_SMALL_SIZE && size_to_index(size) == size_to_index(old_size)) return ptr;
+  }
+
+  //Otherwise move the object
+  void* moved = xxmalloc(size);
+  if (moved == NULL) return NULL;
+  memcpy(moved, ptr, old_size < size ? old_size : size);
+  xxfree(ptr);
+  return moved;
+}
+
+/**
+ * Get the available size of an allocated object. This function should return the amount of space
  * that was actually allocated by malloc, not the amount that was requested.
  * \param ptr   A pointer somewhere inside the allocated object
  * \returns     The number of bytes available for use in this object
  */
 size_t xxmalloc_usable_size(void* ptr) {
-  // If ptr is NULL always return zero
-  if (ptr == NULL) return 0;
-  intptr_t address = (intptr_t)ptr;
-  //Finding the address of the page of the ptrs
-  intptr_t page_start = address - (address % PAGE_SIZE);
-  page_header_t* header = (page_header_t*)page_start;
-  //Checking whether the page belongs to the allocator
-  if (header->magic != MAGIC_NUMBER) return 0;
-  //Return the data store in the header block of the page
-  return header->object_size;
+  //Large objects live outside the heap range, start on a page boundary, and have their size in
+  //the large object table. NULL and foreign pointers end up here too and get zero.
+  if (!in_heap(ptr)) {
+    intptr_t address = (intptr_t)ptr;
+    if (ptr == NULL || address % PAGE_SIZE != 0) return 0;
+    pthread_mutex_lock(&large_lock);
+    large_entry_t* entry = large_table_find(address);
+    size_t size = entry == NULL ? 0 : entry->size;
+    pthread_mutex_unlock(&large_lock);
+    return size;
+  }
+
+  //Checking whether the page holds objects: a small page or the first page of a medium object
+  size_t page = page_number(ptr);
+  if (page_classes[page] == 0) return 0;
+  //Arena objects keep their size just in front of them
+  if (page_classes[page] == PAGE_CLASS_ARENA) return ((size_t*)ptr)[-1];
+  //Return the size kept in the page's header
+  return page_headers[page].object_size;
+}
+
+
+/**
+ * Give as much free memory back to the OS as possible: the calling thread's cached objects along
+ * with those other threads sent to it or to exited threads, every size class's empty pages, the
+ * contents of all free spans, and all cached large mappings.
+ * \param pad   Ignored; there is no single heap top to leave padding at
+ * \returns     1 if any memory was released, otherwise 0
+ */
+int xxmalloc_trim(size_t pad) {
+  bool released = false;
+
+  //Collect objects sent to this thread and to threads that have exited, then return them all
+  thread_cache_t* cache = &thread_cache;
+  for (uint16_t owner = 1; owner < MAX_PAGE_OWNERS; owner++) {
+    if (owner == cache->owner || !__atomic_load_n(&remote_lists[owner].active, __ATOMIC_ACQUIRE)) {
+      drain_remote_frees(cache, &remote_lists[owner]);
+    }
+  }
+  flush_thread_cache(cache);
+  if (cache->rseq != NULL) flush_cpu_cache(cache);
+
+  //Empty pages wait on a list of their own in each size class
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    central_list_t* central = &central_lists[index];
+    pthread_mutex_lock(&central->lock);
+    if (release_empty_pages(central, 0) != 0) released = true;
+    pthread_mutex_unlock(&central->lock);
+  }
+
+  pthread_mutex_lock(&superblock_lock);
+  if (huge_pages) {
+    //Only whole huge pages go back, so none is split. Those given back by an earlier trim, or
+    //never touched, are skipped until something is allocated in them again.
+    for (size_t huge = 0; huge < heap_mapped / HUGE_PAGE_SIZE; huge++) {
+      if (huge_page_used[huge] != 0) continue;
+      if (huge_page_released[huge / 64] & (1UL << (huge % 64))) continue;
+      release_memory(heap_start + huge * HUGE_PAGE_SIZE, HUGE_PAGE_SIZE);
+      huge_page_released[huge / 64] |= 1UL << (huge % 64);
+      released = true;
+    }
+  } else {
+    for (int bin = 1; bin <= MAX_MEDIUM_PAGES; bin++) {
+      for (span_t* span = free_spans[bin]; span != NULL; span = span->next) {
+        release_memory(span_start(span), (size_t)span->pages * PAGE_SIZE);
+        released = true;
+      }
+    }
+  }
+  pthread_mutex_unlock(&superblock_lock);
+
+  pthread_mutex_lock(&large_lock);
+  while (large_cache_count > 0) {
+    large_cache_count--;
+    unmap_memory((void*)large_cache[large_cache_count].address, large_cache[large_cache_count].size);
+    released = true;
+  }
+  large_cache_bytes = 0;
+  large_cache_aged = 0;
+  pthread_mutex_unlock(&large_lock);
+
+  return released;
+}
+
+/**
+ * Print the allocator's statistics to standard error: allocations, frees, live objects and
+ * pages held for every size class, followed by the allocator's system calls.
+ */
+void xxmalloc_stats(void) {
+  report_stats(true);
+}
+
+/**
+ * Summarize the heap in the form of glibc's mallinfo2. Superblocks, which hold small and medium
+ * objects, count as the arena; large objects count as mmapped regions.
+ * \returns     The heap summary
+ */
+struct mallinfo2 xxmallinfo2(void) {
+  heap_stats_t stats;
+  collect_stats(&stats, true);
+
+  size_t in_use = STAT_READ(arena_bytes);
+  for (int row = 0; row < NUM_STATS_CLASSES - 1; row++) {
+    if (stats.allocations[row] > stats.frees[row]) {
+      in_use += (stats.allocations[row] - stats.frees[row]) * stats.object_sizes[row];
+    }
+  }
+
+  struct mallinfo2 info;
+  memset(&info, 0, sizeof(info));
+  info.arena = STAT_READ(superblock_count) * SUPERBLOCK_SIZE;
+  info.hblks = stats.allocations[NUM_STATS_CLASSES - 1] - stats.frees[NUM_STATS_CLASSES - 1];
+  info.hblkhd = stats.pages[NUM_STATS_CLASSES - 1] * PAGE_SIZE;
+  info.uordblks = in_use;
+  info.fordblks = info.arena > in_use ? info.arena - in_use : 0;
+  return info;
+}
+
+/**
+ * Lock every heap lock so no other thread is inside the allocator. Used prior to fork().
+ */
+void xxmalloc_lock(void) {
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    pthread_mutex_lock(&central_lists[index].lock);
+  }
+  pthread_mutex_lock(&superblock_lock);
+  pthread_mutex_lock(&large_lock);
+  pthread_mutex_lock(&stats_lock);
+}
+
+/**
+ * Release the heap locks taken by xxmalloc_lock, after fork() returns in the parent.
+ */
+void xxmalloc_unlock(void) {
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&large_lock);
+  pthread_mutex_unlock(&superblock_lock);
+  for (int index = NUM_SIZE_CLASSES - 1; index >= 0; index--) {
+    pthread_mutex_unlock(&central_lists[index].lock);
+  }
+}
+
+/**
+ * Reset the heap locks in a forked child. Only the forking thread survives, so the locks
+ * xxmalloc_lock took in the parent are reinitialized rather than unlocked. Objects cached by
+ * the parent's other threads are simply never seen again in the child, and their remote free
+ * lists are marked inactive so the child's frees stop going to them. The scavenger thread does
+ * not survive the fork either, so the child gives empty pages back as they empty.
+ */
+void xxmalloc_fork_child(void) {
+  scavenger_on = false;
+  empty_pages_limit = EMPTY_PAGES_KEPT;
+  //The other threads' remote free lists are left for new threads to adopt
+  for (uint16_t owner = 1; owner < MAX_PAGE_OWNERS; owner++) {
+    if (owner != thread_cache.owner) remote_lists[owner].active = false;
+  }
+  for (int index = 0; index < NUM_SIZE_CLASSES; index++) {
+    pthread_mutex_init(&central_lists[index].lock, NULL);
+  }
+  pthread_mutex_init(&superblock_lock, NULL);
+  pthread_mutex_init(&large_lock, NULL);
+  pthread_mutex_init(&stats_lock, NULL);
+}
+
+/**
+ * Install the fork handlers when the library is loaded, so every fork() sees a consistent heap.
+ */
+__attribute__((constructor)) void install_fork_handlers(void) {
+  pthread_atfork(xxmalloc_lock, xxmalloc_unlock, xxmalloc_fork_child);
 }
 
 
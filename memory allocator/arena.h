@@ -0,0 +1,39 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Arenas: regions whose objects are all freed together. An arena bump-allocates out of spans
+// taken from the same superblocks as malloc's pages, and arena_reset gives every span back to
+// the shared pool at once. Arena objects are 16-byte aligned and xxmalloc_usable_size reports
+// their size, but they are never freed one at a time. free ignores objects in an arena's spans,
+// but an object too big for a span (over about 256 KiB) is a mapping of its own, so no arena
+// object should be passed to free or the sized frees. Nor may one be passed to realloc, which
+// does not recognise arena objects. An arena is not thread-safe; each one should be used by one
+// thread at a time.
+
+// An arena. Its contents are private to the allocator.
+typedef struct arena_t arena_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Create an empty arena. Returns NULL if no memory could be allocated.
+arena_t* arena_create(void);
+
+// Allocate an object of at least size bytes from an arena. Returns NULL if no memory could be
+// allocated.
+void* arena_alloc(arena_t* arena, size_t size);
+
+// Free every object allocated from an arena, leaving it empty and ready for reuse
+void arena_reset(arena_t* arena);
+
+// Free every object allocated from an arena, and the arena itself
+void arena_destroy(arena_t* arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
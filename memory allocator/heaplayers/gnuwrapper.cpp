@@ -28,9 +28,14 @@
 
   - xxmalloc
   - xxfree
+  - xxfree_sized
+  - xxfree_aligned_sized
   - xxmalloc_usable_size
   - xxmalloc_lock
   - xxmalloc_unlock
+  - xxmalloc_trim
+  - xxmalloc_stats
+  - xxmallinfo2
 
   See the extern "C" block below for function prototypes and more
   details. YOU SHOULD NOT NEED TO MODIFY ANY OF THE CODE HERE TO
@@ -62,12 +67,18 @@ extern "C" {
 WEAK_REDEF1(void*, malloc, size_t);
 WEAK_REDEF1(void, free, void*);
 WEAK_REDEF1(void, cfree, void*);
+WEAK_REDEF2(void, free_sized, void*, size_t);
+WEAK_REDEF3(void, free_aligned_sized, void*, size_t, size_t);
 WEAK_REDEF2(void*, calloc, size_t, size_t);
 WEAK_REDEF2(void*, realloc, void*, size_t);
 WEAK_REDEF2(void*, memalign, size_t, size_t);
 WEAK_REDEF3(int, posix_memalign, void**, size_t, size_t);
 WEAK_REDEF2(void*, aligned_alloc, size_t, size_t);
 WEAK_REDEF1(size_t, malloc_usable_size, void*);
+WEAK_REDEF1(int, malloc_trim, size_t);
+WEAK_REDEF1(void, malloc_stats, void);
+WEAK_REDEF1(struct mallinfo, mallinfo, void);
+WEAK_REDEF1(struct mallinfo2, mallinfo2, void);
 }
 
 #include "wrapper.h"
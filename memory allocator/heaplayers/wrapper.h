@@ -36,11 +36,43 @@
 
 #include <new>
 
+// With TRACE=1, every allocation and free that reaches the allocator is recorded; see trace.h.
+#if defined(XXMALLOC_TRACE)
+#include "../trace.h"
+#define TRACE_OPERATION(op, pointer, argument, size) trace_record(op, pointer, argument, size)
+#else
+#define TRACE_OPERATION(op, pointer, argument, size)
+#endif
+
+// The sampling heap profiler is always built in, and turned on at run time; see profile.h.
+#include "../profile.h"
+
 extern "C" {
 
 void* xxmalloc(size_t);
 void xxfree(void*);
 
+// Frees an object given the size it was allocated with, skipping the size class lookup.
+void xxfree_sized(void*, size_t);
+
+// Frees an object given the alignment and size it was allocated with.
+void xxfree_aligned_sized(void*, size_t, size_t);
+
+// Allocates an object aligned to a power of two.
+void* xxmemalign(size_t, size_t);
+
+// Allocates a zero-filled object, clearing it only if it reuses freed memory.
+void* xxcalloc(size_t, size_t);
+
+// Resizes an object, in place when possible. Returns NULL and leaves the object alone on failure.
+void* xxrealloc(void*, size_t);
+
+// Prints the allocator's per-size-class statistics to standard error.
+void xxmalloc_stats(void);
+
+// Summarizes the heap in the form of glibc's mallinfo2.
+struct mallinfo2 xxmallinfo2(void);
+
 // Takes a pointer and returns how much space it holds.
 size_t xxmalloc_usable_size(void*);
 
@@ -49,6 +81,9 @@ void xxmalloc_lock(void);
 
 // Unlocks the heap(s), after fork().
 void xxmalloc_unlock(void);
+
+// Returns free memory to the OS. Returns 1 if any memory was released.
+int xxmalloc_trim(size_t);
 }
 
 #if defined(__APPLE__)
@@ -84,6 +119,8 @@ void xxmalloc_unlock(void);
 
 #define CUSTOM_MALLOC(x) CUSTOM_PREFIX(malloc)(x)
 #define CUSTOM_FREE(x) CUSTOM_PREFIX(free)(x)
+#define CUSTOM_FREE_SIZED(x, y) CUSTOM_PREFIX(free_sized)(x, y)
+#define CUSTOM_FREE_ALIGNED_SIZED(x, y, z) CUSTOM_PREFIX(free_aligned_sized)(x, y, z)
 #define CUSTOM_CFREE(x) CUSTOM_PREFIX(cfree)(x)
 #define CUSTOM_REALLOC(x, y) CUSTOM_PREFIX(realloc)(x, y)
 #define CUSTOM_CALLOC(x, y) CUSTOM_PREFIX(calloc)(x, y)
@@ -107,6 +144,7 @@ void xxmalloc_unlock(void);
 #define CUSTOM_MALLOC_GET_STATE(p) CUSTOM_PREFIX(malloc_get_state)(p)
 #define CUSTOM_MALLOC_SET_STATE(p) CUSTOM_PREFIX(malloc_set_state)(p)
 #define CUSTOM_MALLINFO(a) CUSTOM_PREFIX(mallinfo)(a)
+#define CUSTOM_MALLINFO2(a) CUSTOM_PREFIX(mallinfo2)(a)
 
 #if defined(_WIN32)
 #define MYCDECL __cdecl
@@ -126,26 +164,46 @@ void xxmalloc_unlock(void);
 /***** generic malloc functions *****/
 
 extern "C" void MYCDECL CUSTOM_FREE(void* ptr) {
+  if (ptr != NULL) {
+    TRACE_OPERATION(TRACE_FREE, ptr, 0, 0);
+  }
+  PROFILE_FREE(ptr);
   xxfree(ptr);
 }
 
+// The C23 sized frees. The size must be the one the object was allocated with.
+extern "C" void MYCDECL CUSTOM_FREE_SIZED(void* ptr, size_t sz) {
+  if (ptr != NULL) {
+    TRACE_OPERATION(TRACE_FREE, ptr, 0, 0);
+  }
+  PROFILE_FREE(ptr);
+  xxfree_sized(ptr, sz);
+}
+
+extern "C" void MYCDECL CUSTOM_FREE_ALIGNED_SIZED(void* ptr, size_t alignment, size_t sz) {
+  if (ptr != NULL) {
+    TRACE_OPERATION(TRACE_FREE, ptr, 0, 0);
+  }
+  PROFILE_FREE(ptr);
+  xxfree_aligned_sized(ptr, alignment, sz);
+}
+
 extern "C" void* MYCDECL CUSTOM_MALLOC(size_t sz) {
   if (sz >> (sizeof(size_t) * 8 - 1)) {
     return NULL;
   }
   void* ptr = xxmalloc(sz);
+  TRACE_OPERATION(TRACE_MALLOC, ptr, 0, sz);
+  PROFILE_ALLOCATION(ptr, sz);
   return ptr;
 }
 
 extern "C" void* MYCDECL CUSTOM_CALLOC(size_t nelem, size_t elsize) {
-  size_t n = nelem * elsize;
-  if (elsize && nelem != n / elsize) {
-    return NULL;
-  }
-  void* ptr = CUSTOM_MALLOC(n);
-  // Zero out the malloc'd block.
+  // The allocator checks for overflow and skips zeroing memory fresh from the kernel.
+  void* ptr = xxcalloc(nelem, elsize);
+  TRACE_OPERATION(TRACE_CALLOC, ptr, 0, nelem * elsize);
   if (ptr != NULL) {
-    memset(ptr, 0, n);
+    PROFILE_ALLOCATION(ptr, nelem * elsize);
   }
   return ptr;
 }
@@ -186,23 +244,13 @@ extern "C" void* MYCDECL CUSTOM_MEMALIGN(size_t alignment, size_t size)
   if ((alignment == 0) || (alignment & (alignment - 1))) {
     return NULL;
   }
-
-  if (alignment == sizeof(double)) {
-    return CUSTOM_MALLOC(size);
-  } else {
-    // Try to just allocate an object of the requested size.
-    // If it happens to be aligned properly, just return it.
-    void* ptr = CUSTOM_MALLOC(size);
-    if (((size_t)ptr & (alignment - 1)) == (size_t)ptr) {
-      // It is already aligned just fine; return it.
-      return ptr;
-    }
-    // It was not aligned as requested: free the object and allocate a big one.
-    CUSTOM_FREE(ptr);
-    ptr = CUSTOM_MALLOC(size + 2 * alignment);
-    void* alignedPtr = (void*)(((size_t)ptr + alignment - 1) & ~(alignment - 1));
-    return alignedPtr;
+  if (size >> (sizeof(size_t) * 8 - 1)) {
+    return NULL;
   }
+  void* ptr = xxmemalign(alignment, size);
+  TRACE_OPERATION(TRACE_MEMALIGN, ptr, alignment, size);
+  PROFILE_ALLOCATION(ptr, size);
+  return ptr;
 }
 
 extern "C" void* MYCDECL CUSTOM_ALIGNED_ALLOC(size_t alignment, size_t size)
@@ -214,7 +262,9 @@ extern "C" void* MYCDECL CUSTOM_ALIGNED_ALLOC(size_t alignment, size_t size)
   // memalign(), except for the added restriction that size should be
   // a multiple of alignment." Rather than check and potentially fail,
   // we just enforce this by rounding up the size, if necessary.
-  size = size + alignment - (size % alignment);
+  if (alignment != 0 && size % alignment != 0) {
+    size = size + alignment - (size % alignment);
+  }
   return CUSTOM_MEMALIGN(alignment, size);
 }
 
@@ -223,7 +273,7 @@ extern "C" size_t MYCDECL CUSTOM_GETSIZE(void* ptr) {
 }
 
 extern "C" void MYCDECL CUSTOM_CFREE(void* ptr) {
-  xxfree(ptr);
+  CUSTOM_FREE(ptr);
 }
 
 extern "C" size_t MYCDECL CUSTOM_GOODSIZE(size_t sz) {
@@ -250,28 +300,22 @@ extern "C" void* MYCDECL CUSTOM_REALLOC(void* ptr, size_t sz) {
 #endif
   }
 
-  size_t objSize = CUSTOM_GETSIZE(ptr);
-
-  void* buf = CUSTOM_MALLOC(sz);
-
-  if (buf != NULL) {
-    if (objSize == CUSTOM_GETSIZE(buf)) {
-      // The objects are the same actual size.
-      // Free the new object and return the original.
-      CUSTOM_FREE(buf);
-      return ptr;
-    }
-    // Copy the contents of the original object
-    // up to the size of the new block.
-    size_t minSize = (objSize < sz) ? objSize : sz;
-    memcpy(buf, ptr, minSize);
+  if (sz >> (sizeof(size_t) * 8 - 1)) {
+    return NULL;
   }
 
-  // Free the old block.
-  CUSTOM_FREE(ptr);
-
-  // Return a pointer to the new one.
-  return buf;
+  // The allocator grows or shrinks the object in place when it can,
+  // and only falls back to allocating, copying and freeing when it can't.
+  // On failure the old object is untouched, so the profiler only forgets it once it is gone.
+  // If another thread is handed the old address and sampled in between, that sample is lost,
+  // which skews the profile far less than dropping live objects on every failed realloc.
+  void* moved = xxrealloc(ptr, sz);
+  TRACE_OPERATION(TRACE_REALLOC, moved, (uintptr_t)ptr, sz);
+  if (moved != NULL) {
+    PROFILE_FREE(ptr);
+    PROFILE_ALLOCATION(moved, sz);
+  }
+  return moved;
 }
 
 #if defined(linux)
@@ -329,13 +373,12 @@ extern "C" int CUSTOM_MALLOPT(int /* param */, int /* value */) {
   return 1;  // success.
 }
 
-extern "C" int CUSTOM_MALLOC_TRIM(size_t /* pad */) {
-  // NOP.
-  return 0;  // no memory returned to OS.
+extern "C" int CUSTOM_MALLOC_TRIM(size_t pad) {
+  return xxmalloc_trim(pad);
 }
 
 extern "C" void CUSTOM_MALLOC_STATS(void) {
-  // NOP.
+  xxmalloc_stats();
 }
 
 extern "C" void* CUSTOM_MALLOC_GET_STATE(void) {
@@ -347,19 +390,24 @@ extern "C" int CUSTOM_MALLOC_SET_STATE(void* /* ptr */) {
 }
 
 #if defined(__GNUC__) && !defined(__FreeBSD__)
+extern "C" struct mallinfo2 CUSTOM_MALLINFO2(void) {
+  return xxmallinfo2();
+}
+
 extern "C" struct mallinfo CUSTOM_MALLINFO(void) {
-  // For now, we return useless stats.
+  // The old interface has int fields, which wrap around just like glibc's do.
+  struct mallinfo2 info = xxmallinfo2();
   struct mallinfo m;
-  m.arena = 0;
-  m.ordblks = 0;
-  m.smblks = 0;
-  m.hblks = 0;
-  m.hblkhd = 0;
-  m.usmblks = 0;
-  m.fsmblks = 0;
-  m.uordblks = 0;
-  m.fordblks = 0;
-  m.keepcost = 0;
+  m.arena = (int)info.arena;
+  m.ordblks = (int)info.ordblks;
+  m.smblks = (int)info.smblks;
+  m.hblks = (int)info.hblks;
+  m.hblkhd = (int)info.hblkhd;
+  m.usmblks = (int)info.usmblks;
+  m.fsmblks = (int)info.fsmblks;
+  m.uordblks = (int)info.uordblks;
+  m.fordblks = (int)info.fordblks;
+  m.keepcost = (int)info.keepcost;
   return m;
 }
 #endif
@@ -423,6 +471,77 @@ void operator delete[](void* ptr)
   CUSTOM_FREE(ptr);
 }
 
+void operator delete(void* ptr, const std::nothrow_t&) throw() {
+  CUSTOM_FREE(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) throw() {
+  CUSTOM_FREE(ptr);
+}
+
+// The compiler passes the size of the object being deleted, so small objects go straight back
+// to their size class without looking up their page.
+#if __cpp_sized_deallocation
+void operator delete(void* ptr, size_t sz) noexcept {
+  CUSTOM_FREE_SIZED(ptr, sz);
+}
+
+void operator delete[](void* ptr, size_t sz) noexcept {
+  CUSTOM_FREE_SIZED(ptr, sz);
+}
+#endif
+
+// Over-aligned types. The alignment is always a power of two, so memalign cannot fail on it.
+#if __cpp_aligned_new
+void* operator new(size_t sz, std::align_val_t alignment) {
+  void* ptr = CUSTOM_MEMALIGN(static_cast<size_t>(alignment), sz);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](size_t sz, std::align_val_t alignment) {
+  void* ptr = CUSTOM_MEMALIGN(static_cast<size_t>(alignment), sz);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(size_t sz, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return CUSTOM_MEMALIGN(static_cast<size_t>(alignment), sz);
+}
+
+void* operator new[](size_t sz, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return CUSTOM_MEMALIGN(static_cast<size_t>(alignment), sz);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  CUSTOM_FREE(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  CUSTOM_FREE(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  CUSTOM_FREE(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  CUSTOM_FREE(ptr);
+}
+
+void operator delete(void* ptr, size_t sz, std::align_val_t alignment) noexcept {
+  CUSTOM_FREE_ALIGNED_SIZED(ptr, static_cast<size_t>(alignment), sz);
+}
+
+void operator delete[](void* ptr, size_t sz, std::align_val_t alignment) noexcept {
+  CUSTOM_FREE_ALIGNED_SIZED(ptr, static_cast<size_t>(alignment), sz);
+}
+#endif
+
 #endif
 #endif
 
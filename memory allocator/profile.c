@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+
+#include "profile.h"
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// The deepest stack recorded for a sample, and the frames of the profiler and the wrapper that
+// are dropped from the top of every stack
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SKIPPED_FRAMES 2
+// The number of distinct stacks the profiler can tell apart (a power of two)
+#define PROFILE_MAX_STACKS (16 * 1024)
+// The number of slots in the live-sample table (a power of two). It is kept at most half full.
+#define PROFILE_MAX_SAMPLES (1024 * 1024)
+// The number of counters in the filter that lets frees of unsampled objects skip the table
+#define PROFILE_FILTER_SIZE (64 * 1024)
+// The size of the buffer a profile is written through
+#define PROFILE_BUFFER_SIZE 4096
+
+//One distinct stack, with the sampled objects allocated from it
+typedef struct profile_stack_t {
+  uint64_t hash;                   // hash of the frames, 0 if the slot is empty
+  uint32_t depth;                  // the number of frames
+  uintptr_t frames[PROFILE_MAX_DEPTH];
+  size_t live_objects;             // sampled objects from this stack not yet freed
+  size_t live_bytes;
+  size_t total_objects;            // every sampled object from this stack
+  size_t total_bytes;
+} profile_stack_t;
+
+//One live sampled object
+typedef struct profile_sample_t {
+  uintptr_t address; // the object, 0 if the slot is empty
+  uint32_t stack;    // index of its stack in the stack table
+  size_t size;       // the bytes requested
+} profile_sample_t;
+
+//A buffered writer for profiles, so writing one makes few system calls and no allocations
+typedef struct profile_writer_t {
+  int fd;
+  size_t length;
+  char buffer[PROFILE_BUFFER_SIZE];
+} profile_writer_t;
+
+__thread int64_t profile_countdown __attribute__((tls_model("initial-exec")));
+size_t profile_live_samples = 0;
+
+//The profiler runs inside malloc, so it never calls malloc itself: its tables are mapped
+//directly, and the kernel only backs the parts that are touched. profile_lock guards them.
+static bool profile_enabled = false;
+static bool profile_at_exit = false;
+static size_t profile_rate = PROFILE_DEFAULT_RATE;
+static char* profile_prefix = PROFILE_DEFAULT_FILE;
+static size_t profile_sequence = 0;
+static profile_stack_t* profile_stacks = NULL;
+static profile_sample_t* profile_samples = NULL;
+static size_t profile_stack_count = 0;
+static size_t profile_dropped = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//The number of live samples whose address hashes to each counter. A free whose counter is zero
+//cannot be of a sampled object, so it returns without taking profile_lock. The counters are only
+//written under the lock.
+static uint16_t* profile_filter = NULL;
+
+//Set while the calling thread is inside the profiler, so allocations made while taking a stack
+//trace are not sampled in turn; and the calling thread's random number state
+static __thread bool profile_busy __attribute__((tls_model("initial-exec")));
+static __thread uint64_t profile_random_state __attribute__((tls_model("initial-exec")));
+
+//Set once the calling thread's countdown holds a drawn interval. A new thread's countdown starts
+//at zero, so without this its first allocation would always be sampled.
+static __thread bool profile_started __attribute__((tls_model("initial-exec")));
+
+// A utility logging function that definitely does not call malloc or free
+void log_message(char* message);
+
+/**
+  * \brief Draw the next sampling interval. Intervals are exponentially distributed with a mean
+  *        of profile_rate, which makes the chance of sampling an allocation depend only on its
+  *        size, so pprof can scale the samples back up.
+  * \return int64_t the number of bytes until the next sample
+  */
+int64_t profile_next_interval(void) {
+  //xorshift64*, seeded per thread from its stack address and the clock
+  if (profile_random_state == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    profile_random_state = ((uintptr_t)&now ^ (uint64_t)now.tv_nsec) | 1;
+  }
+  profile_random_state ^= profile_random_state >> 12;
+  profile_random_state ^= profile_random_state << 25;
+  profile_random_state ^= profile_random_state >> 27;
+  uint64_t bits = profile_random_state * 0x2545F4914F6CDD1DULL;
+
+  //A uniform value in (0, 1], from the top 53 bits
+  double uniform = ((bits >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (int64_t)(-log(uniform) * profile_rate) + 1;
+}
+
+
+/**
+  * \brief Find the filter counter of an object
+  * \param address the object
+  * \return uint16_t* the counter
+  */
+uint16_t* profile_filter_counter(uintptr_t address) {
+  //The top bits of a Fibonacci hash are its best mixed
+  return &profile_filter[(address * 11400714819323198485ULL) >> 48];
+}
+
+
+/**
+  * \brief Find the slot for an object in the live-sample table. Caller holds profile_lock.
+  * \param address the object
+  * \return size_t the slot holding the object, or the empty slot where it would go
+  */
+size_t profile_sample_slot(uintptr_t address) {
+  //Fibonacci hashing spreads addresses that differ only in their high bits
+  size_t slot = (address * 11400714819323198485ULL) & (PROFILE_MAX_SAMPLES - 1);
+  while (profile_samples[slot].address != 0 && profile_samples[slot].address != address) {
+    slot = (slot + 1) & (PROFILE_MAX_SAMPLES - 1);
+  }
+  return slot;
+}
+
+
+/**
+  * \brief Find or add the entry for a stack in the stack table. Caller holds profile_lock.
+  * \param frames the stack's frames, innermost first
+  * \param depth the number of frames
+  * \return int the stack's index, or -1 if the table is full
+  */
+int profile_find_stack(uintptr_t* frames, int depth) {
+  //FNV-1a over the frames; 0 marks an empty slot, so it is never a hash
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ frames[i]) * 1099511628211ULL;
+  }
+  if (hash == 0) hash = 1;
+
+  size_t slot = hash & (PROFILE_MAX_STACKS - 1);
+  while (profile_stacks[slot].hash != 0) {
+    profile_stack_t* stack = &profile_stacks[slot];
+    if (stack->hash == hash && stack->depth == (uint32_t)depth &&
+        memcmp(stack->frames, frames, depth * sizeof(uintptr_t)) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & (PROFILE_MAX_STACKS - 1);
+  }
+
+  //Keep a quarter of the table empty so probe sequences stay short
+  if ((profile_stack_count + 1) * 4 > PROFILE_MAX_STACKS * 3) return -1;
+  profile_stack_count++;
+  profile_stacks[slot].hash = hash;
+  profile_stacks[slot].depth = depth;
+  memcpy(profile_stacks[slot].frames, frames, depth * sizeof(uintptr_t));
+  return slot;
+}
+
+
+/**
+  * \brief Record a sample for an allocation that took the calling thread's countdown below
+  *        zero, and start a new sampling interval
+  * \param pointer the object allocated, or NULL if the allocation failed
+  * \param size the bytes requested
+  */
+void profile_sample(void* pointer, size_t size) {
+  if (!profile_enabled) {
+    //Never sample again, until the profiler is turned on
+    profile_countdown = INT64_MAX;
+    return;
+  }
+  if (!profile_started) {
+    //Count the allocation that got here against the thread's first real interval
+    profile_started = true;
+    profile_countdown += profile_next_interval();
+    if (profile_countdown >= 0) return;
+  }
+  if (profile_busy) {
+    profile_countdown = profile_rate;
+    return;
+  }
+  profile_busy = true;
+  profile_countdown = profile_next_interval();
+
+  if (pointer != NULL) {
+    uintptr_t frames[PROFILE_MAX_DEPTH + PROFILE_SKIPPED_FRAMES];
+    int depth = backtrace((void**)frames, PROFILE_MAX_DEPTH + PROFILE_SKIPPED_FRAMES);
+    int skipped = depth > PROFILE_SKIPPED_FRAMES ? PROFILE_SKIPPED_FRAMES : 0;
+
+    pthread_mutex_lock(&profile_lock);
+    int stack = profile_find_stack(frames + skipped, depth - skipped);
+    if (stack == -1 || (profile_live_samples + 1) * 2 > PROFILE_MAX_SAMPLES) {
+      profile_dropped++;
+    } else {
+      profile_stacks[stack].live_objects++;
+      profile_stacks[stack].live_bytes += size;
+      profile_stacks[stack].total_objects++;
+      profile_stacks[stack].total_bytes += size;
+
+      //The address can already be in the table if a sampled object was freed by a path that is
+      //not profiled; its old sample is replaced
+      profile_sample_t* sample = &profile_samples[profile_sample_slot((uintptr_t)pointer)];
+      if (sample->address != 0) {
+        profile_stacks[sample->stack].live_objects--;
+        profile_stacks[sample->stack].live_bytes -= sample->size;
+      } else {
+        __atomic_store_n(&profile_live_samples, profile_live_samples + 1, __ATOMIC_RELAXED);
+        uint16_t* counter = profile_filter_counter((uintptr_t)pointer);
+        __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+      }
+      sample->address = (uintptr_t)pointer;
+      sample->stack = stack;
+      sample->size = size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+  }
+
+  profile_busy = false;
+}
+
+
+/**
+  * \brief Remove an object from the live-sample table if it was sampled
+  * \param pointer the object being freed, or NULL
+  */
+void profile_free(void* pointer) {
+  if (pointer == NULL) return;
+  if (__atomic_load_n(profile_filter_counter((uintptr_t)pointer), __ATOMIC_RELAXED) == 0) return;
+
+  pthread_mutex_lock(&profile_lock);
+  size_t hole = profile_sample_slot((uintptr_t)pointer);
+  if (profile_samples[hole].address == 0) {
+    pthread_mutex_unlock(&profile_lock);
+    return;
+  }
+  profile_stack_t* stack = &profile_stacks[profile_samples[hole].stack];
+  stack->live_objects--;
+  stack->live_bytes -= profile_samples[hole].size;
+  __atomic_store_n(&profile_live_samples, profile_live_samples - 1, __ATOMIC_RELAXED);
+  uint16_t* counter = profile_filter_counter((uintptr_t)pointer);
+  __atomic_store_n(counter, *counter - 1, __ATOMIC_RELAXED);
+
+  //Backward-shift deletion: move later entries of the same probe run into the hole
+  size_t slot = hole;
+  while (true) {
+    slot = (slot + 1) & (PROFILE_MAX_SAMPLES - 1);
+    if (profile_samples[slot].address == 0) break;
+    size_t home = (profile_samples[slot].address * 11400714819323198485ULL) & (PROFILE_MAX_SAMPLES - 1);
+    if (((slot - home) & (PROFILE_MAX_SAMPLES - 1)) >= ((slot - hole) & (PROFILE_MAX_SAMPLES - 1))) {
+      profile_samples[hole] = profile_samples[slot];
+      hole = slot;
+    }
+  }
+  profile_samples[hole].address = 0;
+  pthread_mutex_unlock(&profile_lock);
+}
+
+
+/**
+  * \brief Write out whatever a profile writer has buffered
+  * \param writer the writer
+  */
+void profile_flush(profile_writer_t* writer) {
+  size_t written = 0;
+  while (written < writer->length) {
+    ssize_t result = write(writer->fd, writer->buffer + written, writer->length - written);
+    if (result <= 0) break;
+    written += result;
+  }
+  writer->length = 0;
+}
+
+
+/**
+  * \brief Append text to a profile
+  * \param writer the writer
+  * \param text the text
+  * \param length the number of bytes of text
+  */
+void profile_write(profile_writer_t* writer, const char* text, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (writer->length == PROFILE_BUFFER_SIZE) profile_flush(writer);
+    writer->buffer[writer->length++] = text[i];
+  }
+}
+
+
+/**
+  * \brief Append a NUL-terminated string to a profile
+  * \param writer the writer
+  * \param text the string
+  */
+void profile_write_text(profile_writer_t* writer, const char* text) {
+  profile_write(writer, text, strlen(text));
+}
+
+
+/**
+  * \brief Append a number to a profile, in decimal or in hexadecimal with a 0x prefix
+  * \param writer the writer
+  * \param value the number
+  * \param hex true for hexadecimal
+  */
+void profile_write_number(profile_writer_t* writer, uint64_t value, bool hex) {
+  char digits[24];
+  int count = sizeof(digits);
+  unsigned base = hex ? 16 : 10;
+  do {
+    digits[--count] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value > 0);
+  if (hex) profile_write_text(writer, "0x");
+  profile_write(writer, &digits[count], sizeof(digits) - count);
+}
+
+
+/**
+  * \brief Write the current profile to the next file, in the legacy heap profile format: a
+  *        header with the totals and the sampling rate, one line per stack with its live and
+  *        total sampled objects and bytes, and the process's mappings so pprof can symbolize.
+  * \param wait whether to wait for profile_lock; a signal handler must not, in case the thread
+  *        it interrupted holds the lock
+  */
+void profile_dump(bool wait) {
+  if (wait ? pthread_mutex_lock(&profile_lock) != 0 : pthread_mutex_trylock(&profile_lock) != 0) {
+    log_message("The heap profiler was busy; no profile was written\n");
+    return;
+  }
+
+  //Build <prefix>.<pid>.<sequence>.heap without snprintf, which may allocate
+  profile_writer_t writer;
+  writer.length = 0;
+  writer.fd = -1;
+  profile_write_text(&writer, profile_prefix);
+  profile_write_text(&writer, ".");
+  profile_write_number(&writer, getpid(), false);
+  profile_write_text(&writer, ".");
+  profile_write_number(&writer, profile_sequence++, false);
+  profile_write_text(&writer, ".heap");
+  char path[PROFILE_BUFFER_SIZE];
+  size_t path_length = writer.length < sizeof(path) - 1 ? writer.length : sizeof(path) - 1;
+  memcpy(path, writer.buffer, path_length);
+  path[path_length] = '\0';
+  writer.length = 0;
+
+  writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer.fd == -1) {
+    pthread_mutex_unlock(&profile_lock);
+    log_message("Could not create the heap profile file\n");
+    return;
+  }
+
+  size_t live_objects = 0;
+  size_t live_bytes = 0;
+  size_t total_objects = 0;
+  size_t total_bytes = 0;
+  for (size_t slot = 0; slot < PROFILE_MAX_STACKS; slot++) {
+    if (profile_stacks[slot].hash == 0) continue;
+    live_objects += profile_stacks[slot].live_objects;
+    live_bytes += profile_stacks[slot].live_bytes;
+    total_objects += profile_stacks[slot].total_objects;
+    total_bytes += profile_stacks[slot].total_bytes;
+  }
+
+  profile_write_text(&writer, "heap profile: ");
+  profile_write_number(&writer, live_objects, false);
+  profile_write_text(&writer, ": ");
+  profile_write_number(&writer, live_bytes, false);
+  profile_write_text(&writer, " [");
+  profile_write_number(&writer, total_objects, false);
+  profile_write_text(&writer, ": ");
+  profile_write_number(&writer, total_bytes, false);
+  profile_write_text(&writer, "] @ heap_v2/");
+  profile_write_number(&writer, profile_rate, false);
+  profile_write_text(&writer, "\n");
+
+  for (size_t slot = 0; slot < PROFILE_MAX_STACKS; slot++) {
+    profile_stack_t* stack = &profile_stacks[slot];
+    if (stack->hash == 0) continue;
+    profile_write_number(&writer, stack->live_objects, false);
+    profile_write_text(&writer, ": ");
+    profile_write_number(&writer, stack->live_bytes, false);
+    profile_write_text(&writer, " [");
+    profile_write_number(&writer, stack->total_objects, false);
+    profile_write_text(&writer, ": ");
+    profile_write_number(&writer, stack->total_bytes, false);
+    profile_write_text(&writer, "] @");
+    for (uint32_t i = 0; i < stack->depth; i++) {
+      profile_write_text(&writer, " ");
+      profile_write_number(&writer, stack->frames[i], true);
+    }
+    profile_write_text(&writer, "\n");
+  }
+  pthread_mutex_unlock(&profile_lock);
+
+  //Copy the mappings straight from the kernel
+  profile_write_text(&writer, "\nMAPPED_LIBRARIES:\n");
+  profile_flush(&writer);
+  int maps = open("/proc/self/maps", O_RDONLY);
+  if (maps != -1) {
+    ssize_t length;
+    while ((length = read(maps, writer.buffer, PROFILE_BUFFER_SIZE)) > 0) {
+      writer.length = length;
+      profile_flush(&writer);
+    }
+    close(maps);
+  }
+  close(writer.fd);
+
+  if (profile_dropped > 0) {
+    log_message("The heap profiler's tables filled up; some samples were dropped\n");
+  }
+}
+
+
+/**
+  * \brief Signal handler that writes a profile
+  * \param signal the signal number
+  */
+void profile_dump_on_signal(int signal) {
+  int saved_errno = errno;
+  profile_dump(false);
+  errno = saved_errno;
+}
+
+
+/**
+  * \brief Write a profile when the program exits, if PROFILE_ENV_VAR asked for it
+  */
+__attribute__((destructor)) void profile_dump_at_exit(void) {
+  if (profile_enabled && profile_at_exit) profile_dump(true);
+}
+
+
+/**
+  * \brief Hold profile_lock across fork(), so the child never inherits it held
+  */
+void profile_fork_prepare(void) {
+  pthread_mutex_lock(&profile_lock);
+}
+
+
+/**
+  * \brief Release profile_lock in the parent after fork()
+  */
+void profile_fork_parent(void) {
+  pthread_mutex_unlock(&profile_lock);
+}
+
+
+/**
+  * \brief Reset profile_lock in the child after fork(). Only the forking thread survives, so the
+  *        lock it took in the parent is reinitialized rather than unlocked, as the heap's are.
+  */
+void profile_fork_child(void) {
+  pthread_mutex_init(&profile_lock, NULL);
+}
+
+
+/**
+  * \brief Read PROFILE_ENV_VAR and its companions when the library is loaded, map the tables,
+  *        and install the SIGUSR1 handler if dumps on signal were asked for
+  */
+__attribute__((constructor)) void start_profiler(void) {
+  char* when = getenv(PROFILE_ENV_VAR);
+  if (when == NULL) return;
+
+  char* prefix = getenv(PROFILE_FILE_ENV_VAR);
+  if (prefix != NULL && prefix[0] != '\0') profile_prefix = prefix;
+  char* rate = getenv(PROFILE_RATE_ENV_VAR);
+  if (rate != NULL && strtoull(rate, NULL, 10) > 0) profile_rate = strtoull(rate, NULL, 10);
+
+  profile_stacks = mmap(NULL, PROFILE_MAX_STACKS * sizeof(profile_stack_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  profile_samples = mmap(NULL, PROFILE_MAX_SAMPLES * sizeof(profile_sample_t),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  profile_filter = mmap(NULL, PROFILE_FILTER_SIZE * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (profile_stacks == MAP_FAILED || profile_samples == MAP_FAILED || profile_filter == MAP_FAILED) {
+    log_message("Could not map the heap profiler's tables\n");
+    return;
+  }
+
+  //The first backtrace loads the unwinder, which allocates; do it now rather than mid-sample
+  void* frame;
+  profile_busy = true;
+  backtrace(&frame, 1);
+  profile_busy = false;
+
+  pthread_atfork(profile_fork_prepare, profile_fork_parent, profile_fork_child);
+  profile_at_exit = strstr(when, "exit") != NULL;
+  if (strstr(when, "signal") != NULL) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_dump_on_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+  }
+
+  profile_enabled = true;
+  //Threads that allocated before now stopped counting; restart this one
+  profile_countdown = profile_next_interval();
+  profile_started = true;
+}
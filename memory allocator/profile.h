@@ -0,0 +1,58 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The sampling heap profiler. Setting PROFILE_ENV_VAR makes myallocator.so record a stack trace
+// for roughly one allocation per PROFILE_RATE_ENV_VAR bytes, and keep every sampled object that
+// is still live in a table. The profile is written in the legacy heap profile format that pprof
+// reads, so `pprof <program> <profile>` shows which call sites hold the heap. Only allocations
+// through the malloc family and operator new are sampled; batches and arenas are not.
+
+// The environment variable that turns the profiler on. Its value names when to write a profile:
+// "exit", "signal" (on SIGUSR1), or both.
+#define PROFILE_ENV_VAR "XXMALLOC_PROFILE"
+// The environment variable giving the prefix of the profile file names. Each profile goes to
+// <prefix>.<pid>.<sequence>.heap.
+#define PROFILE_FILE_ENV_VAR "XXMALLOC_PROFILE_FILE"
+// The environment variable giving the mean number of bytes allocated between samples
+#define PROFILE_RATE_ENV_VAR "XXMALLOC_PROFILE_RATE"
+// The prefix and the sampling rate used when their variables are unset
+#define PROFILE_DEFAULT_FILE "xxmalloc"
+#define PROFILE_DEFAULT_RATE (512 * 1024)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The bytes the calling thread may still allocate before its next sample
+extern __thread int64_t profile_countdown __attribute__((tls_model("initial-exec")));
+
+// The number of sampled objects that are still live, so frees skip the table while it is empty
+extern size_t profile_live_samples;
+
+// Record a sample for an allocation that took the calling thread's countdown below zero, and
+// start a new sampling interval
+void profile_sample(void* pointer, size_t size);
+
+// Remove an object from the live-sample table if it was sampled
+void profile_free(void* pointer);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Count an allocation against the sampling interval. Unsampled allocations cost one decrement.
+#define PROFILE_ALLOCATION(pointer, size)                                   \
+  do {                                                                      \
+    if ((profile_countdown -= (int64_t)(size)) < 0) profile_sample(pointer, size); \
+  } while (0)
+
+// Forget a freed object, if any sampled object is live
+#define PROFILE_FREE(pointer)                                                     \
+  do {                                                                            \
+    if (__atomic_load_n(&profile_live_samples, __ATOMIC_RELAXED) != 0) profile_free(pointer); \
+  } while (0)
+
+#endif
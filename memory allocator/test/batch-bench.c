@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The object sizes measured
+#define SIZES {16, 64, 256, 1024}
+
+// The smallest and largest number of objects allocated and freed together
+#define MIN_COUNT 8
+#define MAX_COUNT 4096
+
+// The number of objects allocated and freed for each size and count, spread over as many rounds
+// as it takes
+#define OBJECTS_PER_RUN (1024 * 1024)
+
+/****** Benchmarks ******/
+
+// The batch entry points of the allocator under test
+typedef size_t (*malloc_batch_function)(size_t size, size_t count, void** out);
+typedef void (*free_batch_function)(void** ptrs, size_t count);
+
+// Allocate count objects and free them, over and over, with one malloc and one free per object.
+// Returns nanoseconds per object.
+double time_single(size_t size, size_t count);
+
+// The same, with one batch allocation and one batch free per round. Returns nanoseconds per object.
+double time_batch(size_t size, size_t count);
+
+/****** Implementation ******/
+
+malloc_batch_function malloc_batch;
+free_batch_function free_batch;
+
+// The objects of one round
+void* objects[MAX_COUNT];
+
+// Keeps the compiler from removing objects that are never used
+void* volatile sink;
+
+int main(int argc, char** argv) {
+  // Look the batch functions up at run time, so the benchmark runs against a preloaded allocator
+  malloc_batch = (malloc_batch_function)dlsym(RTLD_DEFAULT, "xxmalloc_batch");
+  free_batch = (free_batch_function)dlsym(RTLD_DEFAULT, "xxfree_batch");
+  if (malloc_batch == NULL || free_batch == NULL) {
+    fprintf(stderr, "Run this with LD_PRELOAD=./myallocator.so, which has xxmalloc_batch\n");
+    return 1;
+  }
+
+  printf("Nanoseconds per object allocated and freed, %d objects per run:\n\n", OBJECTS_PER_RUN);
+  printf("  %8s %8s %12s %12s %10s\n", "size", "count", "single", "batch", "speedup");
+
+  size_t sizes[] = SIZES;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    for (size_t count = MIN_COUNT; count <= MAX_COUNT; count *= 2) {
+      // Warm up so both variants find the size class's pages already in place
+      time_single(sizes[i], count);
+      double single = time_single(sizes[i], count);
+      double batch = time_batch(sizes[i], count);
+      printf("  %8lu %8lu %12.1f %12.1f %9.2fx\n", sizes[i], count, single, batch, single / batch);
+    }
+  }
+  return 0;
+}
+
+double time_single(size_t size, size_t count) {
+  size_t rounds = OBJECTS_PER_RUN / count;
+
+  uint64_t start = now();
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < count; i++) {
+      objects[i] = malloc(size);
+    }
+    sink = objects[count - 1];
+    for (size_t i = 0; i < count; i++) {
+      free(objects[i]);
+    }
+  }
+  uint64_t end = now();
+
+  return (double)(end - start) / (rounds * count);
+}
+
+double time_batch(size_t size, size_t count) {
+  size_t rounds = OBJECTS_PER_RUN / count;
+
+  uint64_t start = now();
+  for (size_t round = 0; round < rounds; round++) {
+    if (malloc_batch(size, count, objects) != count) {
+      fprintf(stderr, "Allocating a batch of %lu objects failed\n", count);
+      exit(1);
+    }
+    sink = objects[count - 1];
+    free_batch(objects, count);
+  }
+  uint64_t end = now();
+
+  return (double)(end - start) / (rounds * count);
+}
@@ -0,0 +1,37 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Helpers shared by the benchmarks. They run against a preloaded allocator, so nothing here
+// allocates.
+
+// Read the monotonic clock in nanoseconds
+static inline uint64_t now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Read the resident set size of this process, in bytes
+static inline size_t resident_bytes() {
+  // Read the file directly, since fopen would allocate from the allocator being measured
+  char buffer[128];
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd == -1) return 0;
+  ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0) return 0;
+  buffer[length] = '\0';
+
+  size_t total_pages;
+  size_t resident_pages;
+  if (sscanf(buffer, "%lu %lu", &total_pages, &resident_pages) != 2) return 0;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+#endif
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The size of the zeroed buffer
+#define CALLOC_BYTES (512UL * 1024 * 1024)
+
+// The distance between the bytes touched after the buffer is allocated
+#define TOUCH_STRIDE (1024 * 1024)
+
+// The number of times the buffer is allocated, touched and freed
+#define ROUNDS 3
+
+/****** Benchmarks ******/
+
+// Allocate a large zeroed buffer, then read and write a few bytes spread across it, the way a
+// sparse table or bitmap would be used. Prints one row of the results table.
+void bench_sparse_calloc(int round);
+
+/****** Implementation ******/
+
+int main(int argc, char** argv) {
+  printf("calloc(1, %lu MiB) followed by touching one byte every %d KiB:\n\n",
+         CALLOC_BYTES / 1024 / 1024, TOUCH_STRIDE / 1024);
+  printf("  %6s %16s %16s %14s %14s\n", "round", "calloc cycles", "touch cycles", "RSS after",
+         "RSS touched");
+
+  for (int round = 1; round <= ROUNDS; round++) {
+    bench_sparse_calloc(round);
+  }
+
+  return 0;
+}
+
+void bench_sparse_calloc(int round) {
+  size_t resident_before = resident_bytes();
+
+  uint64_t start = __rdtsc();
+  char* buffer = calloc(1, CALLOC_BYTES);
+  uint64_t allocated = __rdtsc();
+
+  if (buffer == NULL) {
+    fprintf(stderr, "calloc of %lu bytes failed\n", CALLOC_BYTES);
+    exit(1);
+  }
+
+  size_t resident_allocated = resident_bytes();
+
+  for (size_t i = 0; i < CALLOC_BYTES; i += TOUCH_STRIDE) {
+    if (buffer[i] != 0) {
+      fprintf(stderr, "calloc returned memory that is not zeroed at byte %lu\n", i);
+      exit(1);
+    }
+    buffer[i] = 1;
+  }
+  uint64_t touched = __rdtsc();
+
+  size_t resident_touched = resident_bytes();
+
+  free(buffer);
+
+  printf("  %6d %16lu %16lu %10lu KiB %10lu KiB\n", round, allocated - start, touched - allocated,
+         (resident_allocated - resident_before) / 1024, (resident_touched - resident_before) / 1024);
+}
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <new>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The number of entries kept in the map and the list while they churn
+#define CONTAINER_ENTRIES 100000
+
+// The number of erase/insert rounds timed for each container
+#define CHURN_ROUNDS 2000000
+
+// The number of objects allocated and then deleted together in the raw operator benchmarks
+#define DELETE_BATCH 1000
+
+// The number of batches timed for each raw operator benchmark
+#define DELETE_ROUNDS 2000
+
+/****** Benchmarks ******/
+
+// Churn a std::map: erase a random key and insert a new one, so every round frees one tree node
+// and allocates another. Returns nanoseconds per round.
+double bench_map_churn();
+
+// Churn a std::list: pop the oldest entry and push a new one. Returns nanoseconds per round.
+double bench_list_churn();
+
+// Allocate batches of objects with operator new and delete them, passing the size to operator
+// delete when sized is set. Returns nanoseconds per new/delete pair.
+double bench_delete(size_t size, bool sized);
+
+/****** Implementation ******/
+
+// Keeps the compiler from removing work whose result is never used
+volatile uint64_t sink;
+
+int main(int argc, char** argv) {
+  printf("C++ container churn (%d entries, %d rounds):\n\n", CONTAINER_ENTRIES, CHURN_ROUNDS);
+  printf("  %24s %12s\n", "benchmark", "ns/round");
+  printf("  %24s %12.1f\n", "std::map erase+insert", bench_map_churn());
+  printf("  %24s %12.1f\n", "std::list pop+push", bench_list_churn());
+
+  printf("\nRaw operator new/delete in batches of %d:\n\n", DELETE_BATCH);
+  printf("  %12s %14s %14s\n", "size", "delete(p)", "delete(p, n)");
+  size_t sizes[] = {16, 64, 256, 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    // Warm up so both variants start with the size class already populated
+    bench_delete(sizes[i], false);
+    double unsized = bench_delete(sizes[i], false);
+    double sized = bench_delete(sizes[i], true);
+    printf("  %12lu %14.1f %14.1f\n", sizes[i], unsized, sized);
+  }
+  return 0;
+}
+
+double bench_map_churn() {
+  std::map<uint64_t, uint64_t> map;
+  srandom(1);
+  for (int i = 0; i < CONTAINER_ENTRIES; i++) {
+    map[random()] = i;
+  }
+
+  uint64_t start = now();
+  for (int i = 0; i < CHURN_ROUNDS; i++) {
+    // Erase the first key at or after a random one, wrapping around to the start
+    auto it = map.lower_bound(random());
+    if (it == map.end()) it = map.begin();
+    map.erase(it);
+    map[random()] = i;
+  }
+  uint64_t end = now();
+
+  sink = map.size();
+  return (double)(end - start) / CHURN_ROUNDS;
+}
+
+double bench_list_churn() {
+  std::list<uint64_t> list;
+  for (int i = 0; i < CONTAINER_ENTRIES; i++) {
+    list.push_back(i);
+  }
+
+  uint64_t start = now();
+  for (int i = 0; i < CHURN_ROUNDS; i++) {
+    sink = list.front();
+    list.pop_front();
+    list.push_back(i);
+  }
+  uint64_t end = now();
+
+  return (double)(end - start) / CHURN_ROUNDS;
+}
+
+double bench_delete(size_t size, bool sized) {
+  void* objects[DELETE_BATCH];
+
+  uint64_t start = now();
+  for (int round = 0; round < DELETE_ROUNDS; round++) {
+    for (int i = 0; i < DELETE_BATCH; i++) {
+      objects[i] = ::operator new(size);
+    }
+    if (sized) {
+      for (int i = 0; i < DELETE_BATCH; i++) {
+        ::operator delete(objects[i], size);
+      }
+    } else {
+      for (int i = 0; i < DELETE_BATCH; i++) {
+        ::operator delete(objects[i]);
+      }
+    }
+  }
+  uint64_t end = now();
+
+  return (double)(end - start) / ((uint64_t)DELETE_ROUNDS * DELETE_BATCH);
+}
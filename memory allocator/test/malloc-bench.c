@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <x86intrin.h>
+
+/****** Benchmark parameters ******/
+
+// The number of malloc/free pairs timed for each small size
+#define SMALL_ITERATIONS 1000000
+
+// The number of objects allocated and then freed together for each small size
+#define SMALL_BATCH 1000
+
+// The number of malloc/free pairs and the batch size for each large size
+#define LARGE_ITERATIONS 1000
+#define LARGE_BATCH 16
+
+// The bytes of never-freed objects allocated for each size in the first-touch benchmark
+#define FIRST_TOUCH_BYTES (1024 * 1024)
+
+// The object size of every small size class, as in the allocator's SIZE_CLASS_LIST
+#define SMALL_CLASS_SIZES                                                                 \
+  {16,  32,  48,  64,  80,  96,   112,  128,  160,  192,  224,  256,                      \
+   320, 384, 448, 512, 640, 768,  896,  1024, 1280, 1536, 1792, 2048}
+
+/****** Benchmarks ******/
+
+// Time repeated malloc/free pairs of one size. Returns cycles per pair.
+double time_pairs(size_t size, int iterations);
+
+// Time allocating a batch of objects and then freeing them. Reports cycles per call.
+void time_batch(size_t size, int count, double* malloc_cycles, double* free_cycles);
+
+// Print one row of the results table
+void bench_size(size_t size, int iterations, int batch);
+
+// Time allocations that have to come from fresh pages, and count the page faults they cause.
+// This runs before anything else so no size has any free memory yet.
+void bench_first_touch(size_t size);
+
+// Read the number of minor page faults this process has taken
+long minor_faults();
+
+/****** Implementation ******/
+
+// Keeps the compiler from removing malloc/free pairs whose result is never used
+void* volatile sink;
+
+int main(int argc, char** argv) {
+  printf("First-touch allocation from fresh pages (%d KiB of objects per size):\n\n",
+         FIRST_TOUCH_BYTES / 1024);
+  printf("  %12s %14s %14s %14s\n", "size", "first malloc", "malloc", "faults/page");
+
+  size_t small_sizes[] = SMALL_CLASS_SIZES;
+  size_t small_count = sizeof(small_sizes) / sizeof(small_sizes[0]);
+  for (size_t i = 0; i < small_count; i++) {
+    bench_first_touch(small_sizes[i]);
+  }
+
+  printf("\nCycles per operation for each size class:\n\n");
+  printf("  %12s %14s %14s %14s\n", "size", "malloc+free", "malloc", "free");
+
+  // Every small size class, measured at its largest request size
+  for (size_t i = 0; i < small_count; i++) {
+    bench_size(small_sizes[i], SMALL_ITERATIONS, SMALL_BATCH);
+  }
+
+  // Medium and large objects, where the cost of rounding to whole pages used to grow with the size
+  size_t large_sizes[] = {2049,        64 * 1024,        256 * 1024,
+                          1024 * 1024, 64 * 1024 * 1024, 1024 * 1024 * 1024};
+  for (size_t i = 0; i < sizeof(large_sizes) / sizeof(large_sizes[0]); i++) {
+    bench_size(large_sizes[i], LARGE_ITERATIONS, LARGE_BATCH);
+  }
+
+  return 0;
+}
+
+void bench_size(size_t size, int iterations, int batch) {
+  // Warm up so that every size starts with its first page or mapping already in place
+  time_pairs(size, iterations / 10);
+
+  double pair_cycles = time_pairs(size, iterations);
+
+  double malloc_cycles;
+  double free_cycles;
+  time_batch(size, batch, &malloc_cycles, &free_cycles);
+
+  printf("  %12lu %14.1f %14.1f %14.1f\n", size, pair_cycles, malloc_cycles, free_cycles);
+}
+
+void bench_first_touch(size_t size) {
+  int count = FIRST_TOUCH_BYTES / size;
+  void** pointers = malloc(count * sizeof(void*));
+
+  long faults_before = minor_faults();
+
+  // The very first allocation has to set up a new page for the size
+  uint64_t start = __rdtsc();
+  pointers[0] = malloc(size);
+  uint64_t first = __rdtsc();
+  for (int i = 1; i < count; i++) {
+    pointers[i] = malloc(size);
+  }
+  uint64_t end = __rdtsc();
+
+  long faults = minor_faults() - faults_before;
+
+  // Keep the objects, so no later measurement reuses these pages
+  sink = pointers;
+
+  printf("  %12lu %14lu %14.1f %14.2f\n", size, first - start, (double)(end - first) / (count - 1),
+         (double)faults * 4096 / FIRST_TOUCH_BYTES);
+}
+
+long minor_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+double time_pairs(size_t size, int iterations) {
+  uint64_t start = __rdtsc();
+  for (int i = 0; i < iterations; i++) {
+    sink = malloc(size);
+    free(sink);
+  }
+  uint64_t end = __rdtsc();
+
+  return (double)(end - start) / iterations;
+}
+
+void time_batch(size_t size, int count, double* malloc_cycles, double* free_cycles) {
+  void** pointers = malloc(count * sizeof(void*));
+
+  uint64_t start = __rdtsc();
+  for (int i = 0; i < count; i++) {
+    pointers[i] = malloc(size);
+  }
+  uint64_t middle = __rdtsc();
+  for (int i = 0; i < count; i++) {
+    free(pointers[i]);
+  }
+  uint64_t end = __rdtsc();
+
+  free(pointers);
+
+  *malloc_cycles = (double)(middle - start) / count;
+  *free_cycles = (double)(end - middle) / count;
+}
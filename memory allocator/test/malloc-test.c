@@ -19,7 +19,13 @@
 
 #elif defined(__linux__)
 
+#include <dlfcn.h>
 #include <malloc.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define rip(c) (c->uc_mcontext.gregs[REG_RIP])
 #define rsp(c) (c->uc_mcontext.gregs[REG_RSP])
@@ -37,7 +43,7 @@ int test_valid();
 // Test for allocated object sizes
 int test_sizes();
 
-// Test to see if objects are aligned to a multiple of their size
+// Test to see if objects are aligned to the largest power of two dividing their size
 int test_alignment();
 
 // Test for non-overlapping objects
@@ -52,6 +58,17 @@ int test_blocks();
 // Test for reasonable large object behavior
 int test_large_objects();
 
+// Test arenas across small, medium and large objects, and their reuse after a reset
+int test_arenas();
+
+/****** Reports (not scored) ******/
+
+// Count the system calls made while allocating many small objects
+void report_syscalls();
+
+// Compare the bytes requested from malloc with the bytes it handed out and the memory it used
+void report_fragmentation();
+
 /****** Utilities ******/
 
 // Check if a given allocation is writable
@@ -103,9 +120,15 @@ int main(int argc, char** argv) {
   total_score += test_large_objects();
   points_possible += 10;
 
+  total_score += test_arenas();
+  points_possible += 10;
+
   printf("Total Score: %d/%d (%.1f%%)\n", total_score, points_possible,
          100 * (float)total_score / points_possible);
 
+  report_syscalls();
+  report_fragmentation();
+
   return 0;
 }
 
@@ -143,7 +166,7 @@ int test_sizes() {
 
   int score = 0;
   int sizes[] = {4, 16, 18, 35, 66, 128, 200, 511, 600, 1025};
-  int expected_sizes[] = {16, 16, 32, 64, 128, 128, 256, 512, 1024, 2048};
+  int expected_sizes[] = {16, 16, 32, 48, 80, 128, 224, 512, 640, 1280};
 
   // Allocate ten objects and make sure they are the appropriate size
   for (size_t i = 0; i < 10; i++) {
@@ -166,18 +189,20 @@ int test_sizes() {
 }
 
 int test_alignment() {
-  printf("3. Are allocated objects size-aligned?\n");
+  printf("3. Are allocated objects naturally aligned?\n");
 
   int score = 0;
   for (int i = 0; i < 10; i++) {
     size_t requested_size = 4 + rand() % 2044;
     void* p = malloc(requested_size);
     size_t sz = malloc_usable_size(p);
+    // Objects must be aligned to the largest power of two that divides their size
+    size_t alignment = sz & -sz;
     if (sz == 0) {
       printf("  malloc(%lu) returned a pointer to zero bytes.\n", requested_size);
-    } else if ((uintptr_t)p % sz != 0) {
+    } else if ((uintptr_t)p % alignment != 0) {
       printf("  malloc(%lu) returned %lu bytes, but %p is not aligned to a multiple of %lu.\n",
-             requested_size, sz, p, sz);
+             requested_size, sz, p, alignment);
     } else {
       printf("  malloc(%lu) returned a properly-aligned pointer.\n", requested_size);
       score++;
@@ -330,10 +355,12 @@ int test_blocks() {
       printf("  malloc(%d) failed to expand to a new page.\n", sizes[i]);
       continue;
     } else {
-      // Allocate until we get yet another page, keeping track of the number of allocated bytes
+      // Allocate until we get yet another page, keeping track of the number of allocated bytes.
+      // A page with no header holds exactly 4096 bytes of objects, so allow one allocation past
+      // a full page before giving up.
       page = newpage;
       allocated = sizes[i];
-      while (allocated < 4096 && page == newpage) {
+      while (allocated <= 4096 && page == newpage) {
         p = malloc(sizes[i]);
         allocated += sizes[i];
 
@@ -406,6 +433,202 @@ int test_large_objects() {
   return score;
 }
 
+// The arena functions of the allocator under test, looked up at run time because this test runs
+// against a preloaded allocator
+typedef void* (*arena_create_function)(void);
+typedef void* (*arena_alloc_function)(void* arena, size_t size);
+typedef void (*arena_reset_function)(void* arena);
+typedef void (*arena_destroy_function)(void* arena);
+
+int test_arenas() {
+  printf("8. Do arenas hand out usable memory, and can they be reset and reused?\n");
+
+  int score = 0;
+
+#if defined(__linux__)
+  arena_create_function arena_create = (arena_create_function)dlsym(RTLD_DEFAULT, "arena_create");
+  arena_alloc_function arena_alloc = (arena_alloc_function)dlsym(RTLD_DEFAULT, "arena_alloc");
+  arena_reset_function arena_reset = (arena_reset_function)dlsym(RTLD_DEFAULT, "arena_reset");
+  arena_destroy_function arena_destroy =
+      (arena_destroy_function)dlsym(RTLD_DEFAULT, "arena_destroy");
+  void* arena = arena_create == NULL ? NULL : arena_create();
+  if (arena_alloc == NULL || arena_reset == NULL || arena_destroy == NULL || arena == NULL) {
+    printf("  The allocator has no arenas.\n");
+    printf(" Test Score: %d/10\n\n", score);
+    return score;
+  }
+
+  // Small, medium, and too big for any span, where the arena falls back to a large mapping
+  size_t sizes[] = {1, 24, 100, 2048, 5000, 40000, 250000, 1048576};
+  size_t count = sizeof(sizes) / sizeof(sizes[0]);
+  void* pointers[count];
+
+  for (size_t i = 0; i < count; i++) {
+    void* p = arena_alloc(arena, sizes[i]);
+    pointers[i] = p;
+    size_t usable = malloc_usable_size(p);
+
+    bool overlap = false;
+    for (size_t j = 0; j < i; j++) {
+      uintptr_t p1 = (uintptr_t)p;
+      uintptr_t p2 = (uintptr_t)pointers[j];
+      if ((p2 >= p1 && p2 < p1 + sizes[i]) || (p1 >= p2 && p1 < p2 + sizes[j])) overlap = true;
+    }
+
+    if (p == NULL || !valid_mem(p, sizes[i])) {
+      printf("  arena_alloc(%lu) returned memory that was not writable.\n", sizes[i]);
+    } else if ((uintptr_t)p % 16 != 0) {
+      printf("  arena_alloc(%lu) returned %p, which is not 16-byte aligned.\n", sizes[i], p);
+    } else if (usable < sizes[i]) {
+      printf("  arena_alloc(%lu) returned an object of only %lu usable bytes.\n", sizes[i], usable);
+    } else if (overlap) {
+      printf("  arena_alloc(%lu) returned memory that overlaps a previous allocation.\n",
+             sizes[i]);
+    } else {
+      printf("  arena_alloc(%lu) returned %lu aligned, writable bytes. (+1 point)\n", sizes[i],
+             usable);
+      score++;
+    }
+  }
+
+  // After a reset the arena starts over and must hand out the same sizes again
+  arena_reset(arena);
+  bool reused = true;
+  for (size_t i = 0; i < count; i++) {
+    void* p = arena_alloc(arena, sizes[i]);
+    if (p == NULL || (uintptr_t)p % 16 != 0 || malloc_usable_size(p) < sizes[i] ||
+        !valid_mem(p, sizes[i])) {
+      reused = false;
+    }
+  }
+  if (reused) {
+    printf("  The arena handed out every size again after a reset. (+1 point)\n");
+    score++;
+  } else {
+    printf("  The arena did not hand out usable memory after a reset.\n");
+  }
+
+  // Destroying the arena gives its spans back to malloc
+  arena_destroy(arena);
+  void* p = malloc(5000);
+  if (valid_mem(p, 5000)) {
+    printf("  malloc still works after arena_destroy. (+1 point)\n");
+    score++;
+  } else {
+    printf("  malloc(5000) returned memory that was not writable after arena_destroy.\n");
+  }
+  free(p);
+#else
+  printf("  Looking up the arena functions is only supported on Linux.\n");
+#endif
+
+  printf(" Test Score: %d/10\n\n", score);
+  return score;
+}
+
+/****** Reports ******/
+
+void report_syscalls() {
+  printf("\nSystem calls made while allocating small objects:\n");
+
+  // The system call number is read from orig_rax, which only x86-64 has
+#if defined(__linux__) && defined(__x86_64__)
+  // Allocate a million 16-byte objects and a thousand of every other small size in a traced
+  // child process, counting each system call it enters.
+  pid_t child = fork();
+  if (child == -1) {
+    perror("fork failed");
+    return;
+  } else if (child == 0) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    for (int i = 0; i < 1000000; i++) {
+      void* p = malloc(16);
+    }
+    for (int sz = 32; sz <= 2048; sz *= 2) {
+      for (int i = 0; i < 1000; i++) {
+        void* p = malloc(sz);
+      }
+    }
+    _exit(0);
+  }
+
+  int status;
+  waitpid(child, &status, 0);
+  ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+  // Each system call stops the child twice: once on entry and once on exit
+  long total = 0;
+  long mmaps = 0;
+  long munmaps = 0;
+  long mprotects = 0;
+  long madvises = 0;
+  bool entering = true;
+  while (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == 0) {
+    waitpid(child, &status, 0);
+    if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+    if (!WIFSTOPPED(status) || WSTOPSIG(status) != (SIGTRAP | 0x80)) continue;
+
+    if (entering) {
+      struct user_regs_struct regs;
+      ptrace(PTRACE_GETREGS, child, NULL, &regs);
+      total++;
+      if (regs.orig_rax == SYS_mmap) mmaps++;
+      if (regs.orig_rax == SYS_munmap) munmaps++;
+      if (regs.orig_rax == SYS_mprotect) mprotects++;
+      if (regs.orig_rax == SYS_madvise) madvises++;
+    }
+    entering = !entering;
+  }
+
+  // A heap that reserves its address range up front grows it with mprotect and hands pages back
+  // with madvise, so those count as heap work too
+  printf("  mmap: %ld, munmap: %ld, mprotect: %ld, madvise: %ld, total: %ld\n\n", mmaps, munmaps,
+         mprotects, madvises, total);
+#else
+  printf("  System call tracing is only supported on x86-64 Linux.\n\n");
+#endif
+}
+
+// The number of objects allocated for the fragmentation report
+#define FRAGMENTATION_OBJECTS 100000
+
+// Read the resident set size of this process, in bytes
+size_t resident_bytes() {
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) return 0;
+  if (fscanf(statm, "%lu %lu", &total_pages, &resident_pages) != 2) resident_pages = 0;
+  fclose(statm);
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+void report_fragmentation() {
+  printf("Fragmentation of %d small objects:\n", FRAGMENTATION_OBJECTS);
+
+  size_t resident_before = resident_bytes();
+
+  // Request sizes are skewed toward small objects, like most programs
+  size_t requested = 0;
+  size_t usable = 0;
+  for (int i = 0; i < FRAGMENTATION_OBJECTS; i++) {
+    size_t sz = 1 + rand() % (rand() % 4 == 0 ? 2048 : 256);
+    void* p = malloc(sz);
+    // Touch the whole object so the memory behind it is resident
+    valid_mem(p, sz);
+    requested += sz;
+    usable += malloc_usable_size(p);
+  }
+
+  size_t resident = resident_bytes() - resident_before;
+
+  printf("  requested: %lu bytes\n", requested);
+  printf("  usable:    %lu bytes (%.1f%% of requested)\n", usable, 100.0 * usable / requested);
+  printf("  resident:  %lu bytes (%.1f%% of requested)\n\n", resident,
+         100.0 * resident / requested);
+}
+
 /****** Utilities ******/
 
 bool valid_mem(void* p, size_t sz) {
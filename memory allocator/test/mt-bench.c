@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The most threads any benchmark runs with
+#define MAX_THREADS 256
+
+// The number of malloc and free calls in each run, shared among its threads
+#define TOTAL_OPS 4000000
+
+// The number of objects each thread keeps live in the larson, churn and mix benchmarks
+#define LIVE_OBJECTS 1000
+
+// One call in this many is timed for the latency percentiles
+#define LATENCY_SAMPLE_INTERVAL 16
+
+// Latencies are counted in buckets four to a doubling, from 1 ns up to 2^48 ns
+#define LATENCY_BUCKETS (48 * 4)
+
+// The number of rounds in the larson benchmark; threads pass their objects on after each round
+#define LARSON_ROUNDS 20
+
+// The aging benchmark grows its live set to this many bytes per thread, then repeatedly frees
+// most of it and regrows it with a different mix of sizes
+#define AGING_LIVE_BYTES (16 * 1024 * 1024)
+#define AGING_PHASES 12
+#define AGING_THREADS 4
+
+// The number of objects each thread keeps live in the idle benchmark
+#define IDLE_LIVE_OBJECTS 64
+
+/****** Benchmarks ******/
+
+// The state and results of one benchmark thread
+typedef struct worker_t {
+  int index;                            // this thread's number, from 0
+  int threads;                          // the number of threads in the run
+  size_t ops;                           // the ops this thread is to do, then the ops it did
+  uint64_t rng;                         // xorshift state
+  uint64_t histogram[LATENCY_BUCKETS];  // sampled latencies
+  size_t live_bytes;                    // bytes this thread holds at the end of the run
+} worker_t;
+
+// A benchmark: a thread body, the thread counts it runs at, and what it measures
+typedef struct benchmark_t {
+  char* name;
+  void* (*run)(void*);
+  int thread_counts[8]; // terminated by 0
+  char* description;
+} benchmark_t;
+
+// Producer/consumer: every thread replaces random objects in its array, then hands the array to
+// the next thread, which frees the objects another thread allocated. Modeled on larson.
+void* larson_thread(void* arg);
+
+// Thread-local churn: each thread replaces random objects of 16 to 512 bytes in its own array
+void* churn_thread(void* arg);
+
+// Realistic sizes and lifetimes: most objects are small and short-lived, a few are big
+void* mix_thread(void* arg);
+
+// Fragmentation aging: a large live set is repeatedly cut down and regrown with a shifting mix of
+// sizes, which leaves partly used pages behind in allocators that cannot reuse them. This runs a
+// fixed number of phases rather than TOTAL_OPS operations.
+void* aging_thread(void* arg);
+
+// Many more threads than cores, each with few live objects: every thread churns through objects
+// of 16 to 2048 bytes, frees them all, and waits for the others. What is still resident then is
+// mostly memory the allocator keeps cached for threads that are not using it.
+void* idle_thread(void* arg);
+
+// Run one benchmark at one thread count in a child process, so its peak RSS is its own
+void run_benchmark(benchmark_t* benchmark, int threads);
+
+/****** Implementation ******/
+
+benchmark_t benchmarks[] = {
+    {"larson", larson_thread, {1, 4, 16, 64}, "cross-thread frees, 16-1024 bytes"},
+    {"churn", churn_thread, {1, 2, 4, 8, 16, 32, 64}, "thread-local replacement, 16-512 bytes"},
+    {"mix", mix_thread, {1, 4, 16, 64}, "realistic size and lifetime mix, 16 bytes-4 MiB"},
+    {"aging", aging_thread, {AGING_THREADS}, "grow, cut and regrow a large live set"},
+    {"idle", idle_thread, {4, 64, 256}, "many threads with few live objects, 16-2048 bytes"},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Every thread's state, and a barrier for the rounds of the larson benchmark
+worker_t workers[MAX_THREADS];
+pthread_barrier_t round_barrier;
+
+// The object arrays of the larson benchmark, which move between threads
+void** larson_arrays[MAX_THREADS];
+
+// The resident set once the aging benchmark's last phase is done, before its survivors are freed
+size_t aged_resident_bytes;
+
+// The resident set once every thread of the idle benchmark has freed its objects
+size_t idle_resident_bytes;
+
+int main(int argc, char** argv) {
+  char* only = argc > 1 ? argv[1] : NULL;
+
+  printf("%-8s %8s %14s %12s %14s\n", "bench", "threads", "ops/sec", "p99 ns", "peak RSS KiB");
+  fflush(stdout);
+
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    if (only != NULL && strcmp(only, benchmarks[i].name) != 0) continue;
+    printf("# %s: %s\n", benchmarks[i].name, benchmarks[i].description);
+    fflush(stdout);
+    for (int t = 0; benchmarks[i].thread_counts[t] != 0; t++) {
+      run_benchmark(&benchmarks[i], benchmarks[i].thread_counts[t]);
+    }
+  }
+
+  return 0;
+}
+
+uint64_t next_random(worker_t* worker) {
+  worker->rng ^= worker->rng << 13;
+  worker->rng ^= worker->rng >> 7;
+  worker->rng ^= worker->rng << 17;
+  return worker->rng;
+}
+
+// Find the histogram bucket of a latency: four buckets per power of two
+int latency_bucket(uint64_t nanoseconds) {
+  if (nanoseconds < 2) return 0;
+  int log = 63 - __builtin_clzll(nanoseconds);
+  int quarter = log >= 2 ? (nanoseconds >> (log - 2)) & 3 : 0;
+  int bucket = log * 4 + quarter;
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// The smallest latency in a bucket
+uint64_t bucket_latency(int bucket) {
+  int log = bucket / 4;
+  if (log < 2) return (uint64_t)1 << log;
+  return ((uint64_t)1 << log) + ((uint64_t)(bucket % 4) << (log - 2));
+}
+
+// malloc, timing one call in LATENCY_SAMPLE_INTERVAL. The first byte is written, as a program
+// would, outside the timed part.
+void* bench_malloc(worker_t* worker, size_t size) {
+  void* ptr;
+  if (worker->ops++ % LATENCY_SAMPLE_INTERVAL == 0) {
+    uint64_t start = now();
+    ptr = malloc(size);
+    worker->histogram[latency_bucket(now() - start)]++;
+  } else {
+    ptr = malloc(size);
+  }
+  if (ptr == NULL) {
+    fprintf(stderr, "malloc(%lu) failed\n", size);
+    exit(1);
+  }
+  *(char*)ptr = 1;
+  return ptr;
+}
+
+// free, timing one call in LATENCY_SAMPLE_INTERVAL
+void bench_free(worker_t* worker, void* ptr) {
+  if (worker->ops++ % LATENCY_SAMPLE_INTERVAL == 0) {
+    uint64_t start = now();
+    free(ptr);
+    worker->histogram[latency_bucket(now() - start)]++;
+  } else {
+    free(ptr);
+  }
+}
+
+void* larson_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  size_t target = worker->ops;
+  worker->ops = 0;
+
+  void** objects = malloc(LIVE_OBJECTS * sizeof(void*));
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    objects[i] = bench_malloc(worker, 16 + next_random(worker) % 1009);
+  }
+
+  for (int round = 0; round < LARSON_ROUNDS; round++) {
+    while (worker->ops < target * (round + 1) / LARSON_ROUNDS) {
+      size_t i = next_random(worker) % LIVE_OBJECTS;
+      bench_free(worker, objects[i]);
+      objects[i] = bench_malloc(worker, 16 + next_random(worker) % 1009);
+    }
+
+    // Pass the array to the next thread, so its objects are freed by a thread that did not
+    // allocate them
+    larson_arrays[worker->index] = objects;
+    pthread_barrier_wait(&round_barrier);
+    objects = larson_arrays[(worker->index + 1) % worker->threads];
+    pthread_barrier_wait(&round_barrier);
+  }
+
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    bench_free(worker, objects[i]);
+  }
+  free(objects);
+  return NULL;
+}
+
+void* churn_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  size_t target = worker->ops;
+  worker->ops = 0;
+
+  void* objects[LIVE_OBJECTS];
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    objects[i] = bench_malloc(worker, 16 + next_random(worker) % 497);
+  }
+  while (worker->ops < target) {
+    size_t i = next_random(worker) % LIVE_OBJECTS;
+    bench_free(worker, objects[i]);
+    objects[i] = bench_malloc(worker, 16 + next_random(worker) % 497);
+  }
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    bench_free(worker, objects[i]);
+  }
+  return NULL;
+}
+
+// Draw a size from a distribution shaped like those measured in server workloads: half of all
+// requests are 64 bytes or less and requests become rarer as they grow
+size_t realistic_size(worker_t* worker) {
+  static const struct {
+    size_t min;
+    size_t max;
+    int per_thousand;
+  } ranges[] = {
+      {16, 32, 250},       {33, 64, 250},          {65, 128, 150},          {129, 256, 120},
+      {257, 512, 80},      {513, 1024, 60},        {1025, 4096, 50},        {4097, 32768, 30},
+      {32769, 262144, 9},  {262145, 4194304, 1},
+  };
+  int pick = next_random(worker) % 1000;
+  for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+    if (pick < ranges[i].per_thousand) {
+      return ranges[i].min + next_random(worker) % (ranges[i].max - ranges[i].min + 1);
+    }
+    pick -= ranges[i].per_thousand;
+  }
+  return 16;
+}
+
+void* mix_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  size_t target = worker->ops;
+  worker->ops = 0;
+
+  void* objects[LIVE_OBJECTS];
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    objects[i] = bench_malloc(worker, realistic_size(worker));
+  }
+  while (worker->ops < target) {
+    // Half of all objects are temporaries freed right away; the rest replace a random long-lived
+    // object, which gives them exponentially distributed lifetimes
+    if (next_random(worker) % 2 == 0) {
+      bench_free(worker, bench_malloc(worker, realistic_size(worker)));
+    } else {
+      size_t i = next_random(worker) % LIVE_OBJECTS;
+      bench_free(worker, objects[i]);
+      objects[i] = bench_malloc(worker, realistic_size(worker));
+    }
+  }
+  for (int i = 0; i < LIVE_OBJECTS; i++) {
+    bench_free(worker, objects[i]);
+  }
+  return NULL;
+}
+
+void* aging_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  worker->ops = 0;
+
+  // Room for the live set even if every object is the smallest size
+  size_t capacity = AGING_LIVE_BYTES / 16;
+  void** objects = malloc(capacity * sizeof(void*));
+  size_t* sizes = malloc(capacity * sizeof(size_t));
+  size_t count = 0;
+  size_t live = 0;
+
+  for (int phase = 0; phase < AGING_PHASES; phase++) {
+    // Each phase favours a different band of sizes, so freed memory does not fit the next phase
+    size_t base = (size_t)16 << (phase % 8);
+
+    //Grow the live set back to its full size
+    while (live < AGING_LIVE_BYTES && count < capacity) {
+      size_t size = base + next_random(worker) % base;
+      if (next_random(worker) % 4 == 0) size = realistic_size(worker);
+      objects[count] = bench_malloc(worker, size);
+      sizes[count] = size;
+      live += size;
+      count++;
+    }
+
+    //Free a random nine in ten objects, leaving survivors scattered over the heap
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (next_random(worker) % 10 == 0) {
+        objects[kept] = objects[i];
+        sizes[kept] = sizes[i];
+        kept++;
+      } else {
+        bench_free(worker, objects[i]);
+        live -= sizes[i];
+      }
+    }
+    count = kept;
+  }
+
+  //Measure the aged heap once every thread is done, while the survivors are still live
+  worker->live_bytes = live;
+  pthread_barrier_wait(&round_barrier);
+  if (worker->index == 0) aged_resident_bytes = resident_bytes();
+  pthread_barrier_wait(&round_barrier);
+
+  for (size_t i = 0; i < count; i++) {
+    free(objects[i]);
+  }
+  free(objects);
+  free(sizes);
+  return NULL;
+}
+
+void* idle_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  size_t target = worker->ops;
+  worker->ops = 0;
+
+  void* objects[IDLE_LIVE_OBJECTS];
+  for (int i = 0; i < IDLE_LIVE_OBJECTS; i++) {
+    objects[i] = bench_malloc(worker, 16 + next_random(worker) % 2033);
+  }
+  while (worker->ops < target) {
+    size_t i = next_random(worker) % IDLE_LIVE_OBJECTS;
+    bench_free(worker, objects[i]);
+    objects[i] = bench_malloc(worker, 16 + next_random(worker) % 2033);
+  }
+  for (int i = 0; i < IDLE_LIVE_OBJECTS; i++) {
+    bench_free(worker, objects[i]);
+  }
+
+  //Measure while every thread is still alive, so no thread's cache has been flushed on exit
+  pthread_barrier_wait(&round_barrier);
+  if (worker->index == 0) idle_resident_bytes = resident_bytes();
+  pthread_barrier_wait(&round_barrier);
+  return NULL;
+}
+
+void run_benchmark(benchmark_t* benchmark, int threads) {
+  pid_t child = fork();
+  if (child == -1) {
+    perror("fork");
+    exit(1);
+  }
+
+  if (child > 0) {
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("%-8s %8d %14s\n", benchmark->name, threads, "failed");
+    }
+    return;
+  }
+
+  memset(workers, 0, sizeof(workers));
+  pthread_barrier_init(&round_barrier, NULL, threads);
+
+  pthread_t handles[MAX_THREADS];
+  uint64_t start = now();
+  for (int i = 0; i < threads; i++) {
+    workers[i].index = i;
+    workers[i].threads = threads;
+    workers[i].ops = TOTAL_OPS / threads;
+    workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    pthread_create(&handles[i], NULL, benchmark->run, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  uint64_t elapsed = now() - start;
+
+  // Add up every thread's work and latency samples, then find the 99th percentile sample
+  size_t ops = 0;
+  size_t live_bytes = 0;
+  uint64_t histogram[LATENCY_BUCKETS] = {0};
+  uint64_t samples = 0;
+  for (int i = 0; i < threads; i++) {
+    ops += workers[i].ops;
+    live_bytes += workers[i].live_bytes;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      histogram[b] += workers[i].histogram[b];
+      samples += workers[i].histogram[b];
+    }
+  }
+  uint64_t seen = 0;
+  int p99 = 0;
+  while (p99 < LATENCY_BUCKETS - 1 && seen + histogram[p99] < samples - samples / 100) {
+    seen += histogram[p99];
+    p99++;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%-8s %8d %14.0f %12lu %14ld\n", benchmark->name, threads, ops * 1e9 / elapsed,
+         bucket_latency(p99 + 1), usage.ru_maxrss);
+  if (benchmark->run == aging_thread) {
+    printf("%-8s %8s after aging: %lu KiB resident for %lu KiB live\n", "", "",
+           aged_resident_bytes / 1024, live_bytes / 1024);
+  }
+  if (benchmark->run == idle_thread) {
+    printf("%-8s %8s after freeing: %lu KiB resident with nothing live\n", "", "",
+           idle_resident_bytes / 1024);
+  }
+  fflush(stdout);
+  exit(0);
+}
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+/****** Benchmark parameters ******/
+
+// The size of the buffer before the first doubling
+#define START_SIZE 16
+
+// The size the buffer is doubled up to
+#define END_SIZE (1024UL * 1024 * 1024)
+
+/****** Benchmarks ******/
+
+// Grow one buffer by doubling it with realloc, the way a growing vector or string would, and
+// write the new half after every step so the contents have to be carried along.
+void bench_doubling();
+
+/****** Implementation ******/
+
+int main(int argc, char** argv) {
+  printf("Doubling one buffer from %d bytes to %lu MiB with realloc:\n\n", START_SIZE,
+         END_SIZE / 1024 / 1024);
+  printf("  %12s %14s %8s\n", "size", "realloc", "moved");
+
+  bench_doubling();
+
+  return 0;
+}
+
+void bench_doubling() {
+  char* buffer = malloc(START_SIZE);
+  memset(buffer, 1, START_SIZE);
+
+  uint64_t total = 0;
+  int moves = 0;
+
+  for (size_t size = START_SIZE * 2; size <= END_SIZE; size *= 2) {
+    uint64_t start = __rdtsc();
+    char* grown = realloc(buffer, size);
+    uint64_t end = __rdtsc();
+
+    if (grown == NULL) {
+      fprintf(stderr, "realloc to %lu bytes failed\n", size);
+      exit(1);
+    }
+
+    // The old half must have come along, wherever the buffer ended up
+    if (grown[size / 2 - 1] != 1) {
+      fprintf(stderr, "realloc to %lu bytes lost the buffer's contents\n", size);
+      exit(1);
+    }
+
+    bool moved = grown != buffer;
+    moves += moved;
+    total += end - start;
+
+    printf("  %12lu %14lu %8s\n", size, end - start, moved ? "yes" : "no");
+
+    memset(grown + size / 2, 1, size / 2);
+    buffer = grown;
+  }
+
+  free(buffer);
+
+  printf("\n  Total: %lu cycles in realloc, %d moves\n", total, moves);
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../trace.h"
+#include "bench-util.h"
+
+/****** Replay parameters ******/
+
+// The number of records read from the trace file at a time
+#define READ_BATCH 4096
+
+// The number of operations between samples of the resident set size
+#define RSS_SAMPLE_INTERVAL 1024
+
+// The number of calls used to measure the cost of reading the clock
+#define CLOCK_CALIBRATION_CALLS 100000
+
+/****** Replay ******/
+
+// One object the trace has allocated and not yet freed: the address the traced program got, and
+// the object this replay allocated in its place.
+typedef struct live_object_t {
+  uint64_t address; // the traced address, 0 if the slot is empty
+  void* replayed;   // the object allocated by the replay
+  size_t size;      // the bytes requested
+} live_object_t;
+
+// Timing totals for one kind of operation
+typedef struct op_stats_t {
+  size_t count;
+  uint64_t nanoseconds;
+} op_stats_t;
+
+// Open a trace file and check its header. Exits on failure.
+int open_trace(char* path, trace_header_t* header);
+
+// Read the record with a given position in the ring, counting from the oldest record kept.
+// Records are read in batches, so they must be asked for in order.
+trace_record_t* read_record(int fd, trace_header_t* header, uint64_t position);
+
+// Re-execute every operation in the trace with this process's allocator, and report the results
+void replay(int fd, trace_header_t* header);
+
+// Find the slot for a traced address in the live object table
+live_object_t* find_object(uint64_t address);
+
+// Remove an object from the live object table
+void remove_object(live_object_t* object);
+
+// Write one byte to every page of an object, as a program using it would
+void touch(void* ptr, size_t size);
+
+/****** Implementation ******/
+
+// The table of live objects, an open-addressing hash table keyed by traced address. It is mapped
+// directly, so the replay's own bookkeeping never goes through the allocator being measured.
+live_object_t* objects;
+size_t object_capacity;
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+    fprintf(stderr, "Record a trace by running a program with a myallocator.so built with\n");
+    fprintf(stderr, "`make TRACE=1` and %s=<trace file> set, then replay it with\n", TRACE_ENV_VAR);
+    fprintf(stderr, "LD_PRELOAD set to the allocator to measure.\n");
+    return 1;
+  }
+
+  trace_header_t header;
+  int fd = open_trace(argv[1], &header);
+  replay(fd, &header);
+  close(fd);
+  return 0;
+}
+
+int open_trace(char* path, trace_header_t* header) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    exit(1);
+  }
+  if (pread(fd, header, sizeof(trace_header_t), 0) != sizeof(trace_header_t) ||
+      header->magic != TRACE_MAGIC || header->capacity == 0) {
+    fprintf(stderr, "%s is not an allocation trace\n", path);
+    exit(1);
+  }
+  return fd;
+}
+
+trace_record_t* read_record(int fd, trace_header_t* header, uint64_t position) {
+  static trace_record_t batch[READ_BATCH];
+  static uint64_t batch_start = UINT64_MAX;
+  static size_t batch_count = 0;
+
+  if (position < batch_start || position >= batch_start + batch_count) {
+    // Once the ring has wrapped, the oldest record is the one after the newest
+    uint64_t first = header->next > header->capacity ? header->next % header->capacity : 0;
+    uint64_t slot = (first + position) % header->capacity;
+
+    // Stop each batch at the end of the ring
+    size_t count = READ_BATCH;
+    if (slot + count > header->capacity) count = header->capacity - slot;
+
+    ssize_t bytes = pread(fd, batch, count * sizeof(trace_record_t),
+                          sizeof(trace_header_t) + slot * sizeof(trace_record_t));
+    if (bytes <= 0) {
+      fprintf(stderr, "The trace file is truncated\n");
+      exit(1);
+    }
+    batch_start = position;
+    batch_count = bytes / sizeof(trace_record_t);
+  }
+  return &batch[position - batch_start];
+}
+
+void replay(int fd, trace_header_t* header) {
+  uint64_t records = header->next < header->capacity ? header->next : header->capacity;
+
+  // At most every record allocates, so twice the record count keeps the table at most half full.
+  // Touch the whole table now, so it is part of the resident baseline rather than the results.
+  object_capacity = 1;
+  while (object_capacity < 2 * records) object_capacity *= 2;
+  objects = mmap(NULL, object_capacity * sizeof(live_object_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (objects == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(objects, 0, object_capacity * sizeof(live_object_t));
+
+  // Reading the clock is not free; measure it so it can be taken out of every operation's time
+  uint64_t calibration_start = now();
+  for (int i = 0; i < CLOCK_CALIBRATION_CALLS; i++) {
+    now();
+  }
+  uint64_t clock_cost = (now() - calibration_start) / CLOCK_CALIBRATION_CALLS;
+
+  char* names[] = {"", "malloc", "calloc", "realloc", "memalign", "free"};
+  op_stats_t ops[TRACE_FREE + 1];
+  memset(ops, 0, sizeof(ops));
+
+  size_t skipped = 0;
+  uint32_t threads = 0;
+  size_t live_bytes = 0;
+  size_t peak_live_bytes = 0;
+  size_t peak_resident = 0;
+  size_t baseline = resident_bytes();
+
+  for (uint64_t position = 0; position < records; position++) {
+    trace_record_t record = *read_record(fd, header, position);
+    if (record.thread > threads) threads = record.thread;
+
+    // Skip slots that were never written, failed allocations, and frees of objects allocated
+    // before the oldest record the ring kept
+    live_object_t* old = NULL;
+    if (record.op == TRACE_FREE || record.op == TRACE_REALLOC) {
+      uint64_t address = record.op == TRACE_FREE ? record.pointer : record.argument;
+      old = find_object(address);
+      if (old->address == 0) old = NULL;
+    }
+    bool unknown = record.op == TRACE_NONE || record.op > TRACE_FREE;
+    bool failed = record.op != TRACE_FREE && record.pointer == 0;
+    if (unknown || failed || (record.op == TRACE_FREE && old == NULL)) {
+      skipped++;
+      continue;
+    }
+
+    void* result = NULL;
+    uint64_t start = now();
+    switch (record.op) {
+      case TRACE_MALLOC:
+        result = malloc(record.size);
+        break;
+      case TRACE_CALLOC:
+        result = calloc(1, record.size);
+        break;
+      case TRACE_REALLOC:
+        result = realloc(old == NULL ? NULL : old->replayed, record.size);
+        break;
+      case TRACE_MEMALIGN:
+        result = memalign(record.argument, record.size);
+        break;
+      case TRACE_FREE:
+        free(old->replayed);
+        break;
+    }
+    uint64_t end = now();
+
+    ops[record.op].count++;
+    ops[record.op].nanoseconds += end - start > clock_cost ? end - start - clock_cost : 0;
+
+    if (old != NULL) {
+      live_bytes -= old->size;
+      remove_object(old);
+    }
+
+    if (record.op != TRACE_FREE) {
+      if (result == NULL) {
+        fprintf(stderr, "Allocating %lu bytes failed\n", record.size);
+        exit(1);
+      }
+      touch(result, record.size);
+
+      // The traced allocator may have handed out this address again before its realloc or free
+      // was recorded. The older object is lost to the trace, so free it here.
+      live_object_t* object = find_object(record.pointer);
+      if (object->address != 0) {
+        live_bytes -= object->size;
+        free(object->replayed);
+      }
+      object->address = record.pointer;
+      object->replayed = result;
+      object->size = record.size;
+      live_bytes += record.size;
+    }
+
+    if (live_bytes > peak_live_bytes) peak_live_bytes = live_bytes;
+    if (position % RSS_SAMPLE_INTERVAL == 0) {
+      size_t resident = resident_bytes();
+      if (resident > peak_resident) peak_resident = resident;
+    }
+  }
+
+  size_t resident = resident_bytes();
+  if (resident > peak_resident) peak_resident = resident;
+
+  printf("Replayed %lu of %lu records from %u threads\n\n", records - skipped, records, threads);
+  printf("  %10s %12s %12s\n", "operation", "count", "ns/op");
+
+  op_stats_t total = {0, 0};
+  for (int op = TRACE_MALLOC; op <= TRACE_FREE; op++) {
+    if (ops[op].count == 0) continue;
+    printf("  %10s %12lu %12.1f\n", names[op], ops[op].count,
+           (double)ops[op].nanoseconds / ops[op].count);
+    total.count += ops[op].count;
+    total.nanoseconds += ops[op].nanoseconds;
+  }
+  if (total.count > 0) {
+    printf("  %10s %12lu %12.1f\n", "all", total.count, (double)total.nanoseconds / total.count);
+  }
+
+  // Fragmentation compares the memory the heap held at its largest with the most the program
+  // ever had live. Both peaks are sampled, so this is an estimate.
+  size_t peak_heap = peak_resident > baseline ? peak_resident - baseline : 0;
+  size_t end_heap = resident > baseline ? resident - baseline : 0;
+  printf("\n  Peak RSS:       %10lu KiB (%lu KiB above the replay's own baseline)\n",
+         peak_resident / 1024, peak_heap / 1024);
+  printf("  Peak live data: %10lu KiB\n", peak_live_bytes / 1024);
+  if (peak_live_bytes > 0) {
+    printf("  Fragmentation:  %10.2f (peak heap RSS / peak live data)\n",
+           (double)peak_heap / peak_live_bytes);
+  }
+  printf("  At the end:     %10lu KiB resident for %lu KiB live\n", end_heap / 1024,
+         live_bytes / 1024);
+}
+
+live_object_t* find_object(uint64_t address) {
+  // Fibonacci hashing spreads addresses that differ only in their high bits
+  size_t slot = (address * 11400714819323198485ULL) & (object_capacity - 1);
+  while (objects[slot].address != 0 && objects[slot].address != address) {
+    slot = (slot + 1) & (object_capacity - 1);
+  }
+  return &objects[slot];
+}
+
+void remove_object(live_object_t* object) {
+  // Backward-shift deletion: move later entries of the same probe run into the hole
+  size_t hole = object - objects;
+  size_t slot = hole;
+  while (true) {
+    slot = (slot + 1) & (object_capacity - 1);
+    if (objects[slot].address == 0) break;
+    size_t home = (objects[slot].address * 11400714819323198485ULL) & (object_capacity - 1);
+    if (((slot - home) & (object_capacity - 1)) >= ((slot - hole) & (object_capacity - 1))) {
+      objects[hole] = objects[slot];
+      hole = slot;
+    }
+  }
+  objects[hole].address = 0;
+}
+
+void touch(void* ptr, size_t size) {
+  char* bytes = (char*)ptr;
+  for (size_t offset = 0; offset < size; offset += 4096) {
+    bytes[offset] = 1;
+  }
+  if (size > 0) bytes[size - 1] = 1;
+}
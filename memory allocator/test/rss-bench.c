@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The number of threads that allocate in bursts
+#define THREADS 4
+
+// The bytes each thread allocates in one burst
+#define BURST_BYTES (32 * 1024 * 1024)
+
+// The number of bursts. Each is followed by a quiet spell in which no thread touches the heap.
+#define BURSTS 4
+
+// The times into each quiet spell at which the resident set is measured, in milliseconds. The
+// last one is the length of the spell.
+#define SAMPLE_TIMES_MS {0, 100, 300, 1000, 3000}
+
+// The share of a burst's objects, in percent, that live on until the next burst
+#define SURVIVOR_PERCENT 10
+
+/****** Benchmarks ******/
+
+// The state of one allocating thread
+typedef struct worker_t {
+  uint64_t rng;       // xorshift state
+  void** survivors;   // objects kept from the last burst
+  size_t count;       // the number of survivors
+} worker_t;
+
+// Allocate a burst of objects with a mix of sizes from 16 bytes to 1 MiB, then free all but a
+// few, which replace the previous burst's survivors
+void* burst_thread(void* arg);
+
+// Read this process's resident bytes that the kernel cannot simply drop, and the bytes it can:
+// pages given back with MADV_FREE stay resident until the kernel needs them
+void resident_kib(size_t* resident, size_t* lazy);
+
+/****** Implementation ******/
+
+worker_t workers[THREADS];
+
+// Every thread waits here before and after each burst
+pthread_barrier_t burst_barrier;
+
+int main(int argc, char** argv) {
+  char* mode = getenv("XXMALLOC_SCAVENGE");
+  printf("%d threads allocate %d MiB each per burst, keeping %d%% until the next burst "
+         "(XXMALLOC_SCAVENGE=%s).\n", THREADS, BURST_BYTES / (1024 * 1024), SURVIVOR_PERCENT,
+         mode == NULL ? "unset" : mode);
+  printf("Resident KiB, not counting MADV_FREE pages, at times into the quiet spell after each "
+         "burst:\n\n");
+
+  size_t times[] = SAMPLE_TIMES_MS;
+  size_t samples = sizeof(times) / sizeof(times[0]);
+  printf("  %6s %10s", "burst", "burst ms");
+  for (size_t s = 0; s < samples; s++) {
+    char label[32];
+    snprintf(label, sizeof(label), "%lu ms", times[s]);
+    printf(" %10s", label);
+  }
+  printf(" %12s\n", "lazy KiB");
+
+  pthread_barrier_init(&burst_barrier, NULL, THREADS + 1);
+  pthread_t handles[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    workers[i].survivors = malloc(BURST_BYTES / 16 * sizeof(void*));
+    pthread_create(&handles[i], NULL, burst_thread, &workers[i]);
+  }
+
+  size_t total_resident = 0;
+  for (int burst = 0; burst < BURSTS; burst++) {
+    uint64_t start = now();
+    pthread_barrier_wait(&burst_barrier);
+    pthread_barrier_wait(&burst_barrier);
+    uint64_t quiet = now();
+    printf("  %6d %10.0f", burst + 1, (quiet - start) / 1e6);
+
+    // The threads are parked on the barrier while the samples are taken
+    size_t resident = 0;
+    size_t lazy = 0;
+    for (size_t s = 0; s < samples; s++) {
+      uint64_t target = quiet + times[s] * 1000000;
+      while (now() < target) usleep(1000);
+      resident_kib(&resident, &lazy);
+      total_resident += resident;
+      printf(" %10lu", resident);
+    }
+    printf(" %12lu\n", lazy);
+    fflush(stdout);
+  }
+  pthread_barrier_wait(&burst_barrier);
+
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(handles[i], NULL);
+  }
+  printf("\nMean resident over the quiet spells: %lu KiB\n", total_resident / (BURSTS * samples));
+  return 0;
+}
+
+uint64_t next_random(worker_t* worker) {
+  worker->rng ^= worker->rng << 13;
+  worker->rng ^= worker->rng >> 7;
+  worker->rng ^= worker->rng << 17;
+  return worker->rng;
+}
+
+// Most requests are small, and they grow rarer as they grow bigger
+size_t burst_size(worker_t* worker) {
+  int pick = next_random(worker) % 1000;
+  if (pick < 700) return 16 + next_random(worker) % 497;
+  if (pick < 950) return 513 + next_random(worker) % 3584;
+  if (pick < 995) return 4097 + next_random(worker) % 61440;
+  return 65537 + next_random(worker) % (1024 * 1024 - 65536);
+}
+
+void* burst_thread(void* arg) {
+  worker_t* worker = (worker_t*)arg;
+  void** objects = malloc(BURST_BYTES / 16 * sizeof(void*));
+
+  for (int burst = 0; burst < BURSTS; burst++) {
+    pthread_barrier_wait(&burst_barrier);
+
+    size_t count = 0;
+    size_t bytes = 0;
+    while (bytes < BURST_BYTES) {
+      size_t size = burst_size(worker);
+      objects[count] = malloc(size);
+      *(char*)objects[count] = 1;
+      bytes += size;
+      count++;
+    }
+
+    // The old survivors go, and a random few of the new objects take their place
+    for (size_t i = 0; i < worker->count; i++) {
+      free(worker->survivors[i]);
+    }
+    worker->count = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (next_random(worker) % 100 < SURVIVOR_PERCENT) {
+        worker->survivors[worker->count++] = objects[i];
+      } else {
+        free(objects[i]);
+      }
+    }
+
+    pthread_barrier_wait(&burst_barrier);
+  }
+
+  pthread_barrier_wait(&burst_barrier);
+  for (size_t i = 0; i < worker->count; i++) {
+    free(worker->survivors[i]);
+  }
+  free(worker->survivors);
+  free(objects);
+  return NULL;
+}
+
+void resident_kib(size_t* resident, size_t* lazy) {
+  *resident = 0;
+  *lazy = 0;
+  FILE* file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL) return;
+  char line[256];
+  size_t value;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "Rss: %lu kB", &value) == 1) *resident = value;
+    if (sscanf(line, "LazyFree: %lu kB", &value) == 1) *lazy = value;
+  }
+  fclose(file);
+  *resident = *resident > *lazy ? *resident - *lazy : 0;
+}
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench-util.h"
+
+/****** Benchmark parameters ******/
+
+// The heap sizes walked, in MiB of nodes
+#define HEAP_SIZES_MIB {16, 64, 256}
+
+// The size of one node. Each is a separate small allocation.
+#define NODE_SIZE 64
+
+// The number of hops timed for each heap size
+#define HOPS (20 * 1000 * 1000)
+
+// The churn test ends with this many nodes live. It first allocates CHURN_GROWTH times as many,
+// then CHURN_ROUNDS times frees a random half of the live nodes and allocates fewer replacements.
+// Nodes die in groups of CHURN_GROUP that were allocated one after another, the way the nodes of
+// one data structure tend to.
+#define CHURN_LIVE_NODES (256 * 1024)
+#define CHURN_GROWTH 4
+#define CHURN_ROUNDS 16
+#define CHURN_GROUP 16
+
+/****** Benchmarks ******/
+
+// A node in the chain. The rest of the object is padding up to NODE_SIZE.
+typedef struct node_t {
+  struct node_t* next;
+} node_t;
+
+// Allocate a heap of nodes and link them into one cycle in random order, so every hop is likely
+// to land on a different page. Returns the first node.
+node_t* build_chain(size_t nodes, node_t** all);
+
+// Follow the chain for a number of hops, counting the time and the dTLB misses it takes
+void walk_chain(node_t* start, size_t hops, double* nanoseconds, double* misses);
+
+// Leave a set of live nodes scattered over the heap the way a long-running program does. Fills
+// live with CHURN_LIVE_NODES nodes.
+void churn_nodes(node_t** live);
+
+// Count the distinct pages that hold a set of nodes
+size_t count_pages(node_t** nodes, size_t count);
+
+// Link a set of nodes into one cycle in random order. Returns the first node.
+node_t* link_shuffled(node_t** nodes, size_t count);
+
+// Open a counter of dTLB read misses for this thread. Returns -1 if the kernel does not allow it.
+int open_dtlb_counter();
+
+// Read the kilobytes of this process's anonymous memory backed by transparent huge pages
+size_t huge_page_kib();
+
+/****** Implementation ******/
+
+// Keeps the compiler from removing the walk
+void* volatile sink;
+
+int main(int argc, char** argv) {
+  char* mode = getenv("XXMALLOC_HUGE_PAGES");
+  printf("Pointer chasing through %d-byte nodes, %d hops per heap size (XXMALLOC_HUGE_PAGES=%s):\n\n",
+         NODE_SIZE, HOPS, mode == NULL ? "unset" : mode);
+  printf("  %10s %12s %14s %16s\n", "heap MiB", "ns/hop", "dTLB miss/hop", "huge page KiB");
+
+  size_t sizes[] = HEAP_SIZES_MIB;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t nodes = sizes[i] * 1024 * 1024 / NODE_SIZE;
+    node_t** all = malloc(nodes * sizeof(node_t*));
+    node_t* start = build_chain(nodes, all);
+
+    double nanoseconds;
+    double misses;
+    walk_chain(start, HOPS / 10, &nanoseconds, &misses);
+    walk_chain(start, HOPS, &nanoseconds, &misses);
+    if (misses < 0) {
+      printf("  %10lu %12.1f %14s %16lu\n", sizes[i], nanoseconds, "n/a", huge_page_kib());
+    } else {
+      printf("  %10lu %12.1f %14.3f %16lu\n", sizes[i], nanoseconds, misses, huge_page_kib());
+    }
+
+    for (size_t n = 0; n < nodes; n++) {
+      free(all[n]);
+    }
+    free(all);
+  }
+
+  // After churn, the fewer pages the live nodes are packed onto, the fewer TLB entries a walk
+  // through them needs
+  node_t** live = malloc(CHURN_LIVE_NODES * sizeof(node_t*));
+  churn_nodes(live);
+  size_t pages = count_pages(live, CHURN_LIVE_NODES);
+  node_t* start = link_shuffled(live, CHURN_LIVE_NODES);
+  double nanoseconds;
+  double misses;
+  walk_chain(start, HOPS / 10, &nanoseconds, &misses);
+  walk_chain(start, HOPS, &nanoseconds, &misses);
+  printf("\nAfter churn, %d live nodes fill %lu pages (%lu at best), %lu KiB resident:\n",
+         CHURN_LIVE_NODES, pages, (size_t)CHURN_LIVE_NODES * NODE_SIZE / 4096,
+         resident_bytes() / 1024);
+  if (misses < 0) {
+    printf("  %.1f ns/hop, dTLB misses n/a\n", nanoseconds);
+  } else {
+    printf("  %.1f ns/hop, %.3f dTLB misses/hop\n", nanoseconds, misses);
+  }
+  for (size_t n = 0; n < CHURN_LIVE_NODES; n++) {
+    free(live[n]);
+  }
+  free(live);
+  return 0;
+}
+
+node_t* build_chain(size_t nodes, node_t** all) {
+  for (size_t n = 0; n < nodes; n++) {
+    all[n] = malloc(NODE_SIZE);
+    memset(all[n], 0, NODE_SIZE);
+  }
+
+  // Link a shuffled copy of the node list, leaving the list itself in allocation order for freeing
+  node_t** order = malloc(nodes * sizeof(node_t*));
+  memcpy(order, all, nodes * sizeof(node_t*));
+  node_t* start = link_shuffled(order, nodes);
+  free(order);
+  return start;
+}
+
+node_t* link_shuffled(node_t** nodes, size_t count) {
+  srandom(1);
+  for (size_t n = count - 1; n > 0; n--) {
+    size_t other = random() % (n + 1);
+    node_t* swap = nodes[n];
+    nodes[n] = nodes[other];
+    nodes[other] = swap;
+  }
+  for (size_t n = 0; n < count; n++) {
+    nodes[n]->next = nodes[(n + 1) % count];
+  }
+  return nodes[0];
+}
+
+void churn_nodes(node_t** live) {
+  size_t total = (size_t)CHURN_LIVE_NODES * CHURN_GROWTH;
+  node_t** all = malloc(total * sizeof(node_t*));
+  for (size_t n = 0; n < total; n++) {
+    all[n] = malloc(NODE_SIZE);
+    memset(all[n], 0, NODE_SIZE);
+  }
+
+  // Each round frees a random half of the groups and replaces fewer nodes than it freed, so the
+  // live set shrinks in even steps to CHURN_LIVE_NODES while pages are left partly used. The
+  // list stays in allocation order, so the replacements form the next round's groups.
+  srandom(2);
+  size_t count = total;
+  for (int round = 1; round <= CHURN_ROUNDS; round++) {
+    size_t kept = 0;
+    int dies = 0;
+    for (size_t n = 0; n < count; n++) {
+      if (n % CHURN_GROUP == 0) dies = random() % 2;
+      if (!dies) {
+        all[kept++] = all[n];
+      } else {
+        free(all[n]);
+      }
+    }
+    count = total - (total - CHURN_LIVE_NODES) * round / CHURN_ROUNDS;
+    for (size_t n = kept; n < count; n++) {
+      all[n] = malloc(NODE_SIZE);
+      memset(all[n], 0, NODE_SIZE);
+    }
+  }
+  memcpy(live, all, CHURN_LIVE_NODES * sizeof(node_t*));
+  free(all);
+}
+
+int compare_addresses(const void* a, const void* b) {
+  uintptr_t left = *(const uintptr_t*)a;
+  uintptr_t right = *(const uintptr_t*)b;
+  return left < right ? -1 : left > right;
+}
+
+size_t count_pages(node_t** nodes, size_t count) {
+  uintptr_t* pages = malloc(count * sizeof(uintptr_t));
+  for (size_t n = 0; n < count; n++) {
+    pages[n] = (uintptr_t)nodes[n] / 4096;
+  }
+  qsort(pages, count, sizeof(uintptr_t), compare_addresses);
+  size_t distinct = 0;
+  for (size_t n = 0; n < count; n++) {
+    if (n == 0 || pages[n] != pages[n - 1]) distinct++;
+  }
+  free(pages);
+  return distinct;
+}
+
+void walk_chain(node_t* start, size_t hops, double* nanoseconds, double* misses) {
+  int counter = open_dtlb_counter();
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+
+  uint64_t begin = now();
+  node_t* node = start;
+  for (size_t hop = 0; hop < hops; hop++) {
+    node = node->next;
+  }
+  uint64_t end = now();
+  sink = node;
+
+  *nanoseconds = (double)(end - begin) / hops;
+  *misses = -1;
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count;
+    if (read(counter, &count, sizeof(count)) == sizeof(count)) *misses = (double)count / hops;
+    close(counter);
+  }
+}
+
+int open_dtlb_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+size_t huge_page_kib() {
+  FILE* file = fopen("/proc/self/smaps_rollup", "r");
+  if (file == NULL) return 0;
+  char line[256];
+  size_t kib = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "AnonHugePages: %lu kB", &kib) == 1) break;
+  }
+  fclose(file);
+  return kib;
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+//The mapped trace file, or NULL when nothing is being recorded. The recorder runs inside malloc,
+//so it never calls malloc itself: the ring lives in a shared file mapping, and everything else
+//is either static or on the stack.
+static trace_header_t* trace_header = NULL;
+static trace_record_t* trace_records = NULL;
+
+//The time the trace file was opened, which record timestamps are relative to
+static uint64_t trace_start = 0;
+
+//The number of threads that have recorded an operation, and the calling thread's number
+static uint32_t trace_threads = 0;
+static __thread uint32_t trace_thread __attribute__((tls_model("initial-exec")));
+
+// A utility logging function that definitely does not call malloc or free
+void log_message(char* message);
+
+/**
+  * \brief Read the monotonic clock. This is a vDSO call, so it costs no system call.
+  * \return uint64_t the time in nanoseconds
+  */
+uint64_t trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/**
+  * \brief Append one operation to the trace. Slots are claimed with an atomic increment, so
+  *        threads record concurrently without a lock.
+  * \param op one of the TRACE_ operations
+  * \param pointer the object returned or freed
+  * \param argument the old object for TRACE_REALLOC, the alignment for TRACE_MEMALIGN, else 0
+  * \param size the bytes requested
+  */
+void trace_record(uint32_t op, void* pointer, uintptr_t argument, size_t size) {
+  if (trace_header == NULL) return;
+
+  if (trace_thread == 0) {
+    trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+  }
+
+  uint64_t index = __atomic_fetch_add(&trace_header->next, 1, __ATOMIC_RELAXED);
+  trace_record_t* record = &trace_records[index % trace_header->capacity];
+  record->timestamp = trace_now() - trace_start;
+  record->pointer = (uintptr_t)pointer;
+  record->argument = argument;
+  record->size = size;
+  record->thread = trace_thread;
+  __atomic_store_n(&record->op, op, __ATOMIC_RELEASE);
+}
+
+
+/**
+  * \brief Stop recording in a forked child, so it does not interleave its operations with the
+  *        parent's in the same ring
+  */
+void trace_fork_child(void) {
+  trace_header = NULL;
+  trace_records = NULL;
+}
+
+
+/**
+  * \brief Create and map the trace file named by TRACE_ENV_VAR when the library is loaded.
+  *        The file is sparse, so only the part of the ring that has been written takes space.
+  */
+__attribute__((constructor)) void open_trace(void) {
+  char* path = getenv(TRACE_ENV_VAR);
+  if (path == NULL) return;
+
+  uint64_t capacity = TRACE_DEFAULT_RECORDS;
+  char* records = getenv(TRACE_RECORDS_ENV_VAR);
+  if (records != NULL && strtoull(records, NULL, 10) > 0) {
+    capacity = strtoull(records, NULL, 10);
+  }
+  size_t size = sizeof(trace_header_t) + capacity * sizeof(trace_record_t);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    log_message("Could not create the allocation trace file\n");
+    return;
+  }
+  if (ftruncate(fd, size) != 0) {
+    log_message("Could not size the allocation trace file\n");
+    close(fd);
+    return;
+  }
+  void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (block == MAP_FAILED) {
+    log_message("Could not map the allocation trace file\n");
+    return;
+  }
+
+  trace_header_t* header = (trace_header_t*)block;
+  header->magic = TRACE_MAGIC;
+  header->capacity = capacity;
+  header->next = 0;
+
+  trace_start = trace_now();
+  trace_records = (trace_record_t*)(header + 1);
+  pthread_atfork(NULL, NULL, trace_fork_child);
+  __atomic_store_n(&trace_header, header, __ATOMIC_RELEASE);
+}
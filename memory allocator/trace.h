@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The allocation trace recorder. Building with `make TRACE=1` makes myallocator.so log every
+// malloc, calloc, realloc, memalign and free to the file named by TRACE_ENV_VAR. The file holds a
+// trace_header_t followed by a ring of trace_record_t; once the ring is full the newest records
+// overwrite the oldest. test/replay re-executes a trace against any allocator.
+
+// The environment variable naming the trace file. Nothing is recorded when it is unset.
+#define TRACE_ENV_VAR "XXMALLOC_TRACE"
+// The environment variable giving the number of records the ring holds
+#define TRACE_RECORDS_ENV_VAR "XXMALLOC_TRACE_RECORDS"
+// The number of records the ring holds when TRACE_RECORDS_ENV_VAR is unset
+#define TRACE_DEFAULT_RECORDS (4 * 1024 * 1024)
+// Identifies a trace file
+#define TRACE_MAGIC 0x6563617274787878ULL
+
+// The operations in a trace. A slot that was never written has op TRACE_NONE.
+#define TRACE_NONE 0
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_MEMALIGN 4
+#define TRACE_FREE 5
+
+// The start of a trace file, padded to a cache line
+typedef struct trace_header_t {
+  uint64_t magic;    // TRACE_MAGIC
+  uint64_t capacity; // the number of records in the ring
+  uint64_t next;     // the number of records ever written; record i lives in slot i % capacity
+  uint64_t padding[5];
+} trace_header_t;
+
+// One operation. Pointers are the addresses the traced allocator used, which serve as object ids:
+// an address names one object from the record that returned it to the record that freed it.
+typedef struct trace_record_t {
+  uint64_t timestamp; // nanoseconds since the trace file was opened
+  uint64_t pointer;   // the object returned, or for TRACE_FREE the object freed
+  uint64_t argument;  // the old object for TRACE_REALLOC, the alignment for TRACE_MEMALIGN
+  uint64_t size;      // the bytes requested; count * size for TRACE_CALLOC
+  uint32_t thread;    // the calling thread, numbered from 1 in order of its first operation
+  uint32_t op;        // one of the TRACE_ operations, written last
+} trace_record_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Append one operation to the trace. Frees must be recorded before the object is freed and
+// allocations after they return, so an address is never reused before the record that freed it.
+void trace_record(uint32_t op, void* pointer, uintptr_t argument, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif